@@ -0,0 +1,434 @@
+﻿#include <cstdlib>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <random>
+#include <chrono>
+#include <regex>
+#include <map>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <lmdb++.h>
+#include "core.h"
+#include "lmdb_store.h"
+#include "flat_store.h"
+#include "utils.h"
+#include "input.h"
+#include "timing.h"
+
+using namespace std;
+
+// Times every stage of the pipeline on its own over each dataset and writes the results as JSON.
+// With --baseline, the results are compared against an earlier run and the exit code is 1 when a stage regressed.
+// Usage: NearDupes.Bench [--out file] [--baseline file] [--tolerance 0.15] [--repetitions 3] [--threshold 0.8] [--threads n]
+//                        [--signature-size 64|128|192|256] [input_csv...]
+namespace
+{
+    struct bench_result
+    {
+        std::string dataset;
+        std::string stage;
+        size_t items{};
+        double seconds{};
+        double bytes_per_doc{}; // memory the stage leaves behind, for the stages that build something to keep
+    };
+
+    struct baseline_result
+    {
+        double seconds{};
+        double bytes_per_doc{};
+    };
+
+    struct dataset
+    {
+        vector<std::string> ids;
+        vector<std::string> texts;
+    };
+
+    dataset load_csv(const std::string& path)
+    {
+        dataset data;
+        similarity::input::read_csv(path, [&](string_view docid, string_view doctext) {
+            if (!doctext.empty()) // skipped at ingestion too
+            {
+                data.ids.emplace_back(docid);
+                data.texts.emplace_back(doctext);
+            }
+        });
+        return data;
+    }
+
+    // Ingests the way NearDupes.App does into empty tables: doc ids go to "docids", and every fingerprint is looked up
+    // in "fingerprints" so exact duplicates are recorded in "duplicates" against their first copy
+    void add_documents_as_app(similarity::doc_cacher& cache, MDB_txn* wtxn, similarity::iterate_input_action iterate_input, similarity::put_record_func put_record,
+        similarity::put_signature_func put_signature)
+    {
+        auto ids_dbi = lmdb::dbi::open(wtxn, "docids", MDB_CREATE);
+        auto fingerprints_dbi = lmdb::dbi::open(wtxn, "fingerprints", MDB_CREATE);
+        auto duplicates_dbi = lmdb::dbi::open(wtxn, "duplicates", MDB_CREATE);
+        ids_dbi.drop(wtxn);
+        fingerprints_dbi.drop(wtxn);
+        duplicates_dbi.drop(wtxn);
+
+        similarity::put_id_func put_id = [&](auto key, auto value) { return ids_dbi.put(wtxn, to_key(key), to_val(value), MDB_APPEND); };
+        similarity::put_fingerprint_func put_fingerprint = [&](similarity::doc_id key, const similarity::doc_fingerprint& fingerprint) {
+            lmdb::val fp_key(fingerprint.data(), sizeof(similarity::doc_fingerprint)), value{};
+            if (fingerprints_dbi.get(wtxn, fp_key, value))
+            {
+                auto original = *reinterpret_cast<const similarity::doc_id*>(value.data());
+                auto duplicate = key;
+                duplicates_dbi.put(wtxn, to_key(duplicate), lmdb::val(&original, sizeof(similarity::doc_id)), MDB_APPEND);
+                return original;
+            }
+            fingerprints_dbi.put(wtxn, fp_key, lmdb::val(&key, sizeof(similarity::doc_id)));
+            return key;
+        };
+        cache.add_documents(iterate_input, put_record, put_signature, put_id, put_fingerprint);
+    }
+
+    // One result per line, so the baseline can be read back without a JSON library
+    void write_json(std::ostream& out, const vector<bench_result>& results, size_t thread_count, float threshold, size_t sig_size)
+    {
+        out << "{\n";
+        out << "  \"isa\": \"" << similarity::kernels::isa_name(similarity::kernels::detect_isa()) << "\", \"threads\": " << thread_count << ", \"threshold\": " << threshold << ", \"signature_size\": " << sig_size << ",\n";
+        out << "  \"results\": [\n";
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            const auto& r = results[i];
+            out << "    { \"dataset\": \"" << r.dataset << "\", \"stage\": \"" << r.stage << "\", \"items\": " << r.items
+                << ", \"seconds\": " << r.seconds << ", \"items_per_sec\": " << (r.seconds > 0 ? r.items / r.seconds : 0);
+            if (r.bytes_per_doc > 0)
+            {
+                out << ", \"bytes_per_doc\": " << r.bytes_per_doc;
+            }
+            out << " }"
+                << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        out << "  ]\n}\n";
+    }
+
+    map<pair<std::string, std::string>, baseline_result> read_baseline(const std::string& path)
+    {
+        std::ifstream in(path);
+        if (!in)
+        {
+            throw std::runtime_error{ "Could not read the baseline." };
+        }
+
+        map<pair<std::string, std::string>, baseline_result> baseline;
+        const std::regex result_line(R"|("dataset": "([^"]*)", "stage": "([^"]*)".*"seconds": ([-+.eE0-9]+))|");
+        const std::regex bytes_field(R"|("bytes_per_doc": ([-+.eE0-9]+))|");
+        std::smatch match, bytes;
+        for (std::string line; std::getline(in, line);)
+        {
+            if (std::regex_search(line, match, result_line))
+            {
+                baseline[{ match[1], match[2] }] = { std::stod(match[3]), std::regex_search(line, bytes, bytes_field) ? std::stod(bytes[1]) : 0.0 };
+            }
+        }
+        return baseline;
+    }
+
+    // Stages faster than the noise floor are reported but never flagged. Memory is held to the same tolerance.
+    bool report_regressions(const vector<bench_result>& results, const map<pair<std::string, std::string>, baseline_result>& baseline, double tolerance)
+    {
+        constexpr double noise_floor = 0.001;
+        bool regressed{};
+        for (const auto& r : results)
+        {
+            const auto base = baseline.find({ r.dataset, r.stage });
+            if (base == baseline.end())
+            {
+                std::cout << r.dataset << "/" << r.stage << ": new" << std::endl;
+                continue;
+            }
+
+            const auto change = base->second.seconds > 0 ? r.seconds / base->second.seconds - 1.0 : 0.0;
+            const bool slower = change > tolerance && std::max(r.seconds, base->second.seconds) >= noise_floor;
+            regressed |= slower;
+            std::ostringstream percent;
+            percent << std::showpos << std::fixed << std::setprecision(1) << change * 100;
+            std::cout << (slower ? "REGRESSION " : "") << r.dataset << "/" << r.stage << ": " << base->second.seconds << " s -> " << r.seconds << " s (" << percent.str() << "%)" << std::endl;
+
+            if (r.bytes_per_doc > 0 && base->second.bytes_per_doc > 0)
+            {
+                const auto growth = r.bytes_per_doc / base->second.bytes_per_doc - 1.0;
+                const bool larger = growth > tolerance;
+                regressed |= larger;
+                std::ostringstream bytes_percent;
+                bytes_percent << std::showpos << std::fixed << std::setprecision(1) << growth * 100;
+                std::cout << (larger ? "REGRESSION " : "") << r.dataset << "/" << r.stage << ": " << base->second.bytes_per_doc << " bytes/doc -> " << r.bytes_per_doc << " bytes/doc (" << bytes_percent.str() << "%)" << std::endl;
+            }
+        }
+        return regressed;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    std::string out_path = R"|(/tmp/ndd-bench.json)|";
+    std::string baseline_path;
+    double tolerance = 0.15;
+    size_t repetitions = 3;
+    float similarity_threshold = 0.80f;
+    size_t thread_count = similarity::default_thread_count();
+    size_t sig_size = signature_size;
+    vector<std::string> inputs;
+    for (int i = 1; i < argc; ++i)
+    {
+        const string_view arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--out" && has_value) out_path = argv[++i];
+        else if (arg == "--baseline" && has_value) baseline_path = argv[++i];
+        else if (arg == "--tolerance" && has_value) tolerance = std::stod(argv[++i]);
+        else if (arg == "--repetitions" && has_value) repetitions = std::max<size_t>(1, std::stoul(argv[++i]));
+        else if (arg == "--threshold" && has_value) similarity_threshold = std::stof(argv[++i]);
+        else if (arg == "--threads" && has_value) thread_count = std::stoul(argv[++i]);
+        else if (arg == "--signature-size" && has_value) sig_size = std::stoul(argv[++i]);
+        else inputs.emplace_back(arg);
+    }
+    if (inputs.empty())
+    {
+        for (const auto name : { "enron5", "enron20k", "enron60k", "enron100k", "rc800k" })
+        {
+            inputs.push_back(std::string(R"|(/workspaces/cpp-near-dupes/data/)|") + name + ".csv.bz2");
+        }
+    }
+
+    const std::filesystem::path bench_dir = R"|(/tmp/ndd-bench)|";
+    vector<bench_result> results;
+    for (const auto& input : inputs)
+    {
+        if (!std::filesystem::exists(input))
+        {
+            std::cerr << "Skipping " << input << ", not found" << std::endl;
+            continue;
+        }
+
+        auto name = std::filesystem::path(input).filename().string();
+        name = name.substr(0, name.find('.'));
+        const auto data = load_csv(input);
+        const auto doc_count = data.texts.size();
+        std::cout << "Benchmarking " << name << " (" << doc_count << " docs)" << std::endl;
+        auto add = [&](const char* stage, size_t items, double seconds) { results.push_back({ name, stage, items, seconds }); };
+
+        similarity::with_signature_size(sig_size, [&]<size_t SignatureSize>() {
+            using minhash_sig = similarity::basic_minhash_sig<SignatureSize>;
+
+            const similarity::doc_cacher text_processor{};
+            vector<std::string> normalized(doc_count);
+            add("normalize", doc_count, similarity::time_best_of(repetitions, [&]() {
+                for (size_t i = 0; i < doc_count; ++i) normalized[i] = text_processor.normalize_text(data.texts[i]);
+            }));
+
+            vector<similarity::shingle_set> shingles(doc_count);
+            add("shingle", doc_count, similarity::time_best_of(repetitions, [&]() {
+                for (size_t i = 0; i < doc_count; ++i) shingles[i] = text_processor.generate_shingles(normalized[i]);
+            }));
+
+            // Both steps above in one pass, as ingestion runs them
+            {
+                similarity::shingle_set fused;
+                add("normalize_shingle", doc_count, similarity::time_best_of(repetitions, [&]() {
+                    for (size_t i = 0; i < doc_count; ++i) text_processor.shingle_text(data.texts[i], fused);
+                }));
+            }
+
+            vector<minhash_sig> signatures(doc_count);
+            add("minhash", doc_count, similarity::time_best_of(repetitions, [&]() {
+                for (size_t i = 0; i < doc_count; ++i) signatures[i] = similarity::minhash<SignatureSize>(shingles[i]);
+            }));
+
+            // Every kernel the cpu supports, on the same shingles (coefficients do not change the cost)
+            {
+                std::mt19937 gen(random_seed);
+                vector<uint32_t> coeffs(SignatureSize);
+                std::generate(coeffs.begin(), coeffs.end(), std::ref(gen));
+                minhash_sig sig{};
+                for (auto level = similarity::kernels::isa::scalar; level <= similarity::kernels::detect_isa(); level = static_cast<similarity::kernels::isa>(static_cast<int>(level) + 1))
+                {
+                    const auto kernel = similarity::kernels::kernel_for(level);
+                    const auto stage = std::string("minhash_") + similarity::kernels::isa_name(level);
+                    results.push_back({ name, stage, doc_count, similarity::time_best_of(repetitions, [&]() {
+                        for (const auto& s : shingles) kernel(s, coeffs.data(), sig.data(), sig.size());
+                    }) });
+                }
+            }
+
+            // Scratch cache, emptied and refilled in one transaction per repetition. Opened with MDB_NOSYNC, so the stages
+            // writing it sync it at the end instead, to pay for durability like the flat store stages and the app do.
+            std::filesystem::remove_all(bench_dir);
+            std::filesystem::create_directories(bench_dir);
+            auto env = lmdb::env::create();
+            env.set_mapsize(4UL * 1024UL * 1024UL * 1024UL);
+            env.set_max_dbs(4);
+            env.open(bench_dir.string().c_str(), MDB_NOTLS | MDB_NOSYNC, 0664);
+            {
+                auto wtxn = lmdb::txn::begin(env);
+                lmdb::dbi::open(wtxn, "shingles", MDB_CREATE);
+                wtxn.commit();
+            }
+
+            add("lmdb_put", doc_count, similarity::time_best_of(repetitions, [&]() {
+                auto wtxn = lmdb::txn::begin(env);
+                auto dbi = lmdb::dbi::open(wtxn, "shingles");
+                dbi.drop(wtxn);
+                for (similarity::doc_id idx = 0; idx < doc_count; ++idx)
+                {
+                    auto key = idx;
+                    dbi.put(wtxn, to_key(key), to_val(shingles[idx]), MDB_APPEND);
+                }
+                wtxn.commit();
+                lmdb::env_sync(env, true);
+            }));
+
+            auto rtxn = lmdb::txn::begin(env, nullptr, MDB_RDONLY);
+            auto dbi = lmdb::dbi::open(rtxn, "shingles");
+            size_t checksum{};
+            add("lmdb_get", doc_count, similarity::time_best_of(repetitions, [&]() {
+                for (similarity::doc_id idx = 0; idx < doc_count; ++idx)
+                {
+                    lmdb::val v; auto key = idx; dbi.get(rtxn, to_key(key), v); checksum += v.size();
+                }
+            }));
+
+            // The same records in the flat store, rewritten from scratch and synced per repetition
+            const auto flat_dir = bench_dir / "flat";
+            const similarity::flat_store::commit_record empty_store{ similarity::flat_store::commit_magic, 0, 0 };
+            similarity::flat_store::commit_record flat_committed = empty_store;
+            auto reset_flat = [&]() {
+                std::filesystem::remove_all(flat_dir);
+                std::filesystem::create_directories(flat_dir);
+            };
+            add("flat_put", doc_count, similarity::time_best_of(repetitions, [&]() {
+                reset_flat();
+                similarity::flat_record_writer writer(flat_dir, empty_store);
+                for (similarity::doc_id idx = 0; idx < doc_count; ++idx) writer.put(idx, shingles[idx]);
+                flat_committed = writer.sync();
+            }));
+
+            {
+                const similarity::flat_record_store store(flat_dir, flat_committed);
+                add("flat_get", doc_count, similarity::time_best_of(repetitions, [&]() {
+                    for (similarity::doc_id idx = 0; idx < doc_count; ++idx) checksum += store.seek(idx).size_bytes();
+                }));
+            }
+
+            int band_cnt{}, row_cnt{};
+            std::tie(band_cnt, row_cnt) = similarity::lsh_bands_n_rows(SignatureSize, similarity_threshold);
+            // Every doc added, then every doc queried. The flat index is the one grouping uses; the unordered_map one
+            // it replaced stays for comparison as lsh_map_add/lsh_map_query.
+            vector<pair<similarity::doc_id, similarity::doc_id>> pairs;
+            auto time_index = [&]<typename TLshIndex>(const char* add_stage, const char* query_stage) {
+                add(add_stage, doc_count, similarity::time_best_of(repetitions, [&]() {
+                    TLshIndex lsh(band_cnt, row_cnt);
+                    for (similarity::doc_id idx = 0; idx < doc_count; ++idx) lsh.add(idx, signatures[idx]);
+                }));
+
+                TLshIndex lsh(band_cnt, row_cnt);
+                for (similarity::doc_id idx = 0; idx < doc_count; ++idx) lsh.add(idx, signatures[idx]);
+                results.back().bytes_per_doc = static_cast<double>(lsh.memory_usage()) / doc_count;
+                add(query_stage, doc_count, similarity::time_best_of(repetitions, [&]() {
+                    pairs.clear();
+                    for (similarity::doc_id idx = 0; idx < doc_count; ++idx)
+                    {
+                        for (const auto candidate : lsh.get_candidates(signatures[idx]))
+                        {
+                            if (candidate < idx) pairs.emplace_back(idx, candidate);
+                        }
+                    }
+                }));
+            };
+            time_index.template operator()<similarity::lsh_index>("lsh_map_add", "lsh_map_query");
+            time_index.template operator()<similarity::flat_lsh_index>("lsh_add", "lsh_query");
+
+            // Candidate pairs as LSH returns them, capped so hot buckets do not dominate the run
+            constexpr size_t max_pairs = 1'000'000;
+            pairs.resize(std::min(pairs.size(), max_pairs));
+            float score_sum{};
+            add("jaccard", pairs.size(), similarity::time_best_of(repetitions, [&]() {
+                for (const auto& [a, b] : pairs) score_sum += similarity::calculate_similarity(similarity::shingle_view(shingles[a]), similarity::shingle_view(shingles[b]), similarity_threshold);
+            }));
+            // The min-hash estimate the prefilter checks first, on the same pairs
+            add("prefilter", pairs.size(), similarity::time_best_of(repetitions, [&]() {
+                for (const auto& [a, b] : pairs) score_sum += similarity::estimate_similarity(signatures[a], signatures[b]);
+            }));
+            rtxn.abort();
+
+            // Ingestion into the scratch cache and grouping, as NearDupes.App does it on an empty cache
+            size_t group_count{};
+            add("end_to_end", doc_count, similarity::time_best_of(repetitions, [&]() {
+                auto wtxn = lmdb::txn::begin(env);
+                auto dbi = lmdb::dbi::open(wtxn, "shingles");
+                dbi.drop(wtxn);
+
+                similarity::doc_cacher cache;
+                cache.worker_count = thread_count;
+                cache.signature_lanes = SignatureSize;
+                vector<minhash_sig> cached_signatures;
+                similarity::iterate_input_action iterate_input = [&](similarity::parse_input_action parse) {
+                    for (size_t i = 0; i < doc_count; ++i) parse(data.ids[i], data.texts[i]);
+                };
+                similarity::put_record_func put_record = [&](auto key, const auto& value) { return dbi.put(wtxn, to_key(key), to_val(value), MDB_APPEND); };
+                similarity::put_signature_func put_signature = [&](auto, const auto& value) {
+                    std::copy(value.begin(), value.end(), cached_signatures.emplace_back().begin()); return true;
+                };
+                add_documents_as_app(cache, wtxn, iterate_input, put_record, put_signature);
+                wtxn.commit();
+                lmdb::env_sync(env, true);
+
+                auto rtxn = lmdb::txn::begin(env, nullptr, MDB_RDONLY);
+                auto reader_txns = std::make_unique<per_thread_read_txns>(env);
+                auto records = std::make_unique<similarity::lmdb_record_store>(*reader_txns, dbi);
+                group_count = similarity::find_near_dupes<SignatureSize>(*records, cached_signatures.size(), similarity_threshold, cached_signatures, thread_count).size();
+                records.reset();
+                reader_txns.reset();
+                rtxn.abort();
+            }));
+            // The same with the records in the flat store
+            size_t flat_group_count{};
+            add("end_to_end_flat", doc_count, similarity::time_best_of(repetitions, [&]() {
+                reset_flat();
+                auto wtxn = lmdb::txn::begin(env);
+                std::optional<similarity::flat_record_writer> writer(std::in_place, flat_dir, empty_store);
+                similarity::doc_cacher cache;
+                cache.worker_count = thread_count;
+                cache.signature_lanes = SignatureSize;
+                vector<minhash_sig> cached_signatures;
+                similarity::iterate_input_action iterate_input = [&](similarity::parse_input_action parse) {
+                    for (size_t i = 0; i < doc_count; ++i) parse(data.ids[i], data.texts[i]);
+                };
+                similarity::put_record_func put_record = [&](auto key, const auto& value) { return writer->put(key, value); };
+                similarity::put_signature_func put_signature = [&](auto, const auto& value) {
+                    std::copy(value.begin(), value.end(), cached_signatures.emplace_back().begin()); return true;
+                };
+                add_documents_as_app(cache, wtxn, iterate_input, put_record, put_signature);
+                flat_committed = writer->sync();
+                writer.reset();
+                wtxn.commit();
+                lmdb::env_sync(env, true);
+
+                const similarity::flat_record_store records(flat_dir, flat_committed);
+                flat_group_count = similarity::find_near_dupes<SignatureSize>(records, cached_signatures.size(), similarity_threshold, cached_signatures, thread_count).size();
+            }));
+            std::cout << name << ": " << group_count << " groups (" << flat_group_count << " from the flat store), checksums " << checksum << " " << score_sum << std::endl;
+        });
+    }
+    std::filesystem::remove_all(bench_dir);
+
+    std::ofstream out(out_path);
+    write_json(out, results, thread_count, similarity_threshold, sig_size);
+    out.close();
+    std::cout << "Results written to " << out_path << std::endl;
+
+    if (!baseline_path.empty() && report_regressions(results, read_baseline(baseline_path), tolerance))
+    {
+        return 1;
+    }
+}
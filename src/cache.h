@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <lmdb++.h>
+#include "core.h"
+#include "lsh_state.h"
+#include "lmdb_store.h"
+#include "flat_store.h"
+#include "utils.h"
+
+// Opening and reading the cache NearDupes.App builds, shared by the App, the server and the partition workers
+namespace similarity
+{
+    // The map starts at 1 GiB, a writer grows it between transactions
+    inline lmdb::env open_cache(const std::filesystem::path& dir, unsigned int flags)
+    {
+        auto env = lmdb::env::create();
+        env.set_mapsize(1UL * 1024UL * 1024UL * 1024UL);
+        env.set_max_dbs(7);
+        env.open(dir.string().c_str(), flags, 0664);
+        return env;
+    }
+
+    // The sizes the cache was built with, caches from before they were stored used the defaults
+    inline cache_settings read_cache_settings(MDB_txn* txn)
+    {
+        cache_settings settings{ signature_size, shingle_size };
+        try
+        {
+            lmdb::dbi::open(txn, "settings").get(txn, "sizes", settings);
+        }
+        catch (const lmdb::not_found_error&)
+        {
+        }
+        return settings;
+    }
+
+    // A grouping run removes "grouped" before it writes any group and stores the doc count it grouped once lsh.state is
+    // saved, so the groups and the state are complete when it matches the docs of the cache
+    inline bool groups_complete(MDB_txn* txn, const lmdb::dbi& settings_dbi, uint64_t doc_count)
+    {
+        uint64_t grouped{};
+        return settings_dbi.get(txn, "grouped", grouped) && grouped == doc_count;
+    }
+
+    // (exact duplicate, its first copy) pairs found at ingestion, for the duplicates from first_doc on
+    inline vector<pair<doc_id, doc_id>> read_duplicates(MDB_txn* txn, MDB_dbi duplicates_dbi, doc_id first_doc = 0)
+    {
+        vector<pair<doc_id, doc_id>> duplicates;
+        auto cursor = lmdb::cursor::open(txn, duplicates_dbi);
+        lmdb::val key = to_key(first_doc), value{};
+        for (bool found = cursor.get(key, value, MDB_SET_RANGE); found; found = cursor.get(key, value, MDB_NEXT))
+        {
+            duplicates.emplace_back(from_key(key), *reinterpret_cast<const doc_id*>(value.data()));
+        }
+        cursor.close();
+        return duplicates;
+    }
+
+    // Deletes the entries of a database keyed by doc id from first_doc on
+    inline void erase_docs_from(MDB_txn* txn, lmdb::dbi& dbi, doc_id first_doc)
+    {
+        vector<doc_id> docs;
+        auto cursor = lmdb::cursor::open(txn, dbi);
+        lmdb::val key = to_key(first_doc), value{};
+        for (bool found = cursor.get(key, value, MDB_SET_RANGE); found; found = cursor.get(key, value, MDB_NEXT))
+        {
+            docs.push_back(from_key(key));
+        }
+        cursor.close();
+
+        for (auto doc : docs)
+        {
+            dbi.del(txn, to_key(doc));
+        }
+    }
+
+    // Deletes the fingerprints first seen in docs from first_doc on, which takes a scan of all of them
+    inline void erase_fingerprints_from(MDB_txn* txn, lmdb::dbi& fingerprints_dbi, doc_id first_doc)
+    {
+        vector<doc_fingerprint> fingerprints;
+        auto cursor = lmdb::cursor::open(txn, fingerprints_dbi);
+        lmdb::val key{}, value{};
+        while (cursor.get(key, value, MDB_NEXT))
+        {
+            if (*reinterpret_cast<const doc_id*>(value.data()) >= first_doc)
+            {
+                std::copy_n(key.data(), sizeof(doc_fingerprint), reinterpret_cast<char*>(fingerprints.emplace_back().data()));
+            }
+        }
+        cursor.close();
+
+        for (const auto& fingerprint : fingerprints)
+        {
+            fingerprints_dbi.del(txn, lmdb::val(fingerprint.data(), sizeof(doc_fingerprint)));
+        }
+    }
+
+    template<size_t SignatureSize>
+    basic_minhash_sig<SignatureSize> read_signature(MDB_txn* txn, MDB_dbi sig_dbi, doc_id doc)
+    {
+        lmdb::val value;
+        lmdb::dbi_get(txn, sig_dbi, to_key(doc), value);
+        basic_minhash_sig<SignatureSize> signature;
+        const auto values = to_span<uint32_t>(value);
+        std::copy(values.begin(), values.end(), signature.begin());
+        return signature;
+    }
+
+    // The committed part of the cache's flat shingle store. Ingestion stores its commit record under "flat" in the
+    // settings, in the transaction that commits the signatures and doc ids of the same docs, so after a crash the store
+    // is cut back to what Lmdb holds. Empty before the first commit.
+    inline flat_store::commit_record flat_commit_of(MDB_txn* txn, const lmdb::dbi& settings_dbi)
+    {
+        flat_store::commit_record committed{};
+        return settings_dbi.get(txn, "flat", committed) ? committed : flat_store::commit_record{ flat_store::commit_magic, 0, 0 };
+    }
+
+    // Calls run with the store the cache keeps its shingle sets in, shingles.meta marks the flat one
+    template<typename TRun>
+    void with_cache_records(const std::filesystem::path& dir, MDB_txn* txn, per_thread_read_txns& reader_txns, MDB_dbi dbi, TRun&& run)
+    {
+        if (flat_store::exists(dir))
+        {
+            run(flat_record_store(dir, flat_commit_of(txn, lmdb::dbi::open(txn, "settings"))));
+        }
+        else
+        {
+            run(lmdb_record_store(reader_txns, dbi));
+        }
+    }
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <deque>
+#include <optional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <vector>
+#include <algorithm>
+
+namespace similarity
+{
+    // Unbounded multi-producer/multi-consumer queue. Back-pressure is left to the caller.
+    template<typename T>
+    class work_queue
+    {
+        std::deque<T> items;
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool closed{};
+
+    public:
+        void push(T item)
+        {
+            {
+                std::lock_guard lock(mtx);
+                items.push_back(std::move(item));
+            }
+            cv.notify_one();
+        }
+
+        // Blocks until an item is available, returns empty once the queue is closed and drained.
+        std::optional<T> pop()
+        {
+            std::unique_lock lock(mtx);
+            cv.wait(lock, [this] { return closed || !items.empty(); });
+            if (items.empty())
+            {
+                return std::nullopt;
+            }
+
+            auto item = std::move(items.front());
+            items.pop_front();
+            return item;
+        }
+
+        void close()
+        {
+            {
+                std::lock_guard lock(mtx);
+                closed = true;
+            }
+            cv.notify_all();
+        }
+    };
+
+    // Fixed set of threads running index-parallel jobs. The calling thread takes part in every job,
+    // run() returns once all indices are processed and rethrows the first exception a task raised.
+    class thread_pool
+    {
+        std::vector<std::jthread> threads;
+        std::mutex mtx;
+        std::condition_variable job_ready, job_done;
+        const std::function<void(size_t)>* task{};
+        size_t task_count{};
+        std::atomic<size_t> next_index{};
+        size_t busy{};
+        size_t generation{};
+        bool stopping{};
+        std::exception_ptr error;
+
+        void work()
+        {
+            for (size_t i = next_index++; i < task_count; i = next_index++)
+            {
+                try
+                {
+                    (*task)(i);
+                }
+                catch (...)
+                {
+                    std::lock_guard lock(mtx);
+                    if (!error) error = std::current_exception();
+                }
+            }
+        }
+
+    public:
+        explicit thread_pool(size_t thread_count)
+        {
+            for (size_t i = 1; i < thread_count; ++i)
+            {
+                threads.emplace_back([this]() {
+                    size_t seen{};
+                    while (true)
+                    {
+                        {
+                            std::unique_lock lock(mtx);
+                            job_ready.wait(lock, [&] { return stopping || generation != seen; });
+                            if (stopping) return;
+                            seen = generation;
+                        }
+
+                        work();
+
+                        std::lock_guard lock(mtx);
+                        if (--busy == 0) job_done.notify_one();
+                    }
+                });
+            }
+        }
+
+        ~thread_pool()
+        {
+            {
+                std::lock_guard lock(mtx);
+                stopping = true;
+            }
+            job_ready.notify_all();
+            threads.clear();
+        }
+
+        size_t size() const
+        {
+            return threads.size() + 1;
+        }
+
+        void run(size_t count, const std::function<void(size_t)>& fn)
+        {
+            {
+                std::lock_guard lock(mtx);
+                task = &fn;
+                task_count = count;
+                next_index = 0;
+                busy = threads.size();
+                error = nullptr;
+                ++generation;
+            }
+            job_ready.notify_all();
+
+            work();
+
+            std::unique_lock lock(mtx);
+            job_done.wait(lock, [this] { return busy == 0; });
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+        }
+    };
+
+    inline size_t default_thread_count()
+    {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+}
@@ -2,12 +2,14 @@
 
 #include <cassert>
 #include <cmath>
+#include <cstdlib>
 #include <vector>
 #include <span>
 #include <tuple>
 #include <unordered_set>
 #include <unordered_map>
 #include <functional>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <sstream>
@@ -20,12 +22,26 @@
 #include <chrono>
 #include <cctype>
 #include <filesystem>
+#include <map>
+#include <atomic>
+#include <semaphore>
+#include <mutex>
+#include <exception>
+#include <limits>
+#include <type_traits>
+#include <concepts>
 #include <MurMurHash3.h>
 #include "utils.h"
+#include "concurrency.h"
+#include "minhash_kernels.h"
+#include "set_intersection.h"
+#include "shingle_kernels.h"
+#include "metrics.h"
 
 const size_t random_seed = 71; // very sensitive, causes hash collisions, hence increasing cp amount
-const size_t signature_size = 256; // 192 is a good balance between speed and accuracy when comparing documents, band count should be eq to 6
-const size_t shingle_size = 3;
+const size_t signature_size = 256; // default, see with_signature_size for the others; 192 is a good balance between speed and accuracy
+const size_t max_signature_size = 256;
+const size_t shingle_size = 3; // default words per shingle
 
 namespace similarity
 {
@@ -41,60 +57,273 @@ namespace similarity
     using doc_id = uint32_t;
     using shingle_set = vector<uint32_t>;
     using shingle_view = span<const uint32_t>;
-    using minhash_sig = array<uint32_t, signature_size>;
+    template<size_t SignatureSize>
+    using basic_minhash_sig = array<uint32_t, SignatureSize>;
+    using minhash_sig = basic_minhash_sig<signature_size>;
     using bucket = vector<doc_id>;
     using bucket_list = unordered_map<size_t, bucket>;
     using band_list = vector<bucket_list>;
     using idx_docid_xref = vector<std::string>;
-    using put_record_func = function<bool(doc_id, const shingle_set&)>;
-    using seek_record_func = function<const shingle_view(doc_id)>;
+    using put_record_func = function<bool(doc_id, shingle_view)>;
+    using put_signature_func = function<bool(doc_id, span<const uint32_t>)>;
+    using put_id_func = function<bool(doc_id, string_view)>;
+    using doc_fingerprint = array<uint64_t, 2>;
+    using put_fingerprint_func = function<doc_id(doc_id, const doc_fingerprint&)>;
     using parse_record_action = function<void(doc_id, const shingle_view)>;
-    using iterate_records_action = function<void(parse_record_action)>;
     using parse_input_action = function<void(string_view, string_view)>;
     using iterate_input_action = function<void(parse_input_action)>;
     using nd_groups = unordered_map<doc_id, vector<pair<doc_id, float>>>;
 
+    // What grouping reads cached shingle sets through, templated on so lookups in the candidate loop inline.
+    // seek_many(docs, records) fills records[i] with the shingles of docs[i] in one pass; seek and seek_many may be
+    // called from several threads at once. for_each visits every record in doc id order.
+    template<typename T>
+    concept record_store = requires(const T& store, doc_id doc, span<const doc_id> docs, vector<shingle_view>& records, parse_record_action parse) {
+        { store.seek(doc) } -> std::convertible_to<shingle_view>;
+        store.seek_many(docs, records);
+        store.for_each(parse);
+    };
+
+    // Calls run.template operator()<N>() with N the compiled-in signature size equal to requested (64, 128, 192 or 256)
+    template<typename TRun>
+    decltype(auto) with_signature_size(size_t requested, TRun&& run)
+    {
+        switch (requested)
+        {
+        case 64: return run.template operator()<64>();
+        case 128: return run.template operator()<128>();
+        case 192: return run.template operator()<192>();
+        case 256: return run.template operator()<256>();
+        default: throw std::runtime_error{ "Unsupported signature size " + std::to_string(requested) + ", pick 64, 128, 192 or 256." };
+        }
+    }
+
+    // sig[i] for every lane of sig. Lane i only depends on coefficient i, so a narrower signature is a prefix of a wider one.
+    inline void minhash_into(shingle_view shingles, span<uint32_t> sig)
+    {
+        static const auto coeffs = []()
+        {
+            std::mt19937 rng{ random_seed };
+            std::uniform_int_distribution<uint32_t> uint_dist;
+            array<uint32_t, max_signature_size> coeffs;
+            std::generate(coeffs.begin(), coeffs.end(), [&]() { return uint_dist(rng); });
+            return coeffs;
+        }();
+        static const auto kernel = kernels::kernel_for(kernels::selected_isa());
+        assert(sig.size() <= coeffs.size());
+
+        kernel(shingles, coeffs.data(), sig.data(), sig.size());
+
+        if constexpr (debug_mode)
+        {
+            vector<uint32_t> expected(sig.size());
+            kernels::minhash_scalar(shingles, coeffs.data(), expected.data(), expected.size());
+            assert(std::equal(sig.begin(), sig.end(), expected.begin()) && "vectorized min-hash kernel diverged from the scalar one");
+        }
+    }
+
+    template<size_t SignatureSize = signature_size>
+    inline const basic_minhash_sig<SignatureSize> minhash(shingle_view shingles)
+    {
+        basic_minhash_sig<SignatureSize> sig;
+        minhash_into(shingles, sig);
+        return sig;
+    }
+
+    // 128-bit hash of a sorted shingle set. Docs sharing one are exact duplicates once normalized, their Jaccard index is 1.
+    inline doc_fingerprint fingerprint_of(shingle_view shingles)
+    {
+        doc_fingerprint fingerprint;
+        MurmurHash3_x64_128(shingles.data(), static_cast<int>(shingles.size_bytes()), random_seed, fingerprint.data());
+        return fingerprint;
+    }
+
+    // Share of lanes two signatures agree on, the min-hash estimate of the Jaccard index of their docs
+    template<size_t SignatureSize>
+    inline float estimate_similarity(const basic_minhash_sig<SignatureSize>& a, const basic_minhash_sig<SignatureSize>& b)
+    {
+        static const auto kernel = kernels::equal_lanes_for(kernels::selected_isa());
+        const auto equal = kernel(a.data(), b.data(), a.size());
+        if constexpr (debug_mode)
+        {
+            assert(equal == kernels::equal_lanes_scalar(a.data(), b.data(), a.size()) && "vectorized lane count diverged from the scalar one");
+        }
+        return static_cast<float>(equal) / a.size();
+    }
+
+    // Candidates estimated more than this below the threshold skip the exact check. The xor min-hash family is not
+    // min-wise independent, so estimates stray further than lane count alone suggests. The prefilter is lossy: a match
+    // it drops can leave a doc in another group or make it a representative. On enron100k the default dropped none of
+    // the 3804, 3651, 3135, 2647 and 14 candidates matching at thresholds 0.5, 0.6, 0.7, 0.8 and 0.9, while skipping
+    // 1-8% of the candidates; narrower signatures estimate worse. NDD_PREFILTER_MARGIN=1 turns it off.
+    inline float prefilter_margin()
+    {
+        static const float margin = []() {
+            const char* value = std::getenv("NDD_PREFILTER_MARGIN");
+            return value ? std::stof(value) : 0.2f;
+        }();
+        return margin;
+    }
 
     struct doc_cacher
     {
-        idx_docid_xref xref;
+        idx_docid_xref xref; // empty when ids are handed to put_id instead
+        doc_id first_idx{}; // index of the first added doc, non-zero when appending to an existing cache
+        size_t doc_count{}; // docs added so far
+        size_t duplicate_count{}; // docs added so far that put_fingerprint found an earlier copy of
+        size_t worker_count = default_thread_count();
+        size_t batch_size = 512; // rows handed to a worker at once
+        size_t window_size = shingle_size; // words per shingle
+        size_t signature_lanes = signature_size; // of the signatures handed to put_signature
 
         inline string_view get_id_for(doc_id idx) const
         {
-            return xref.at(idx);
+            return xref.at(idx - first_idx);
         }
 
-        void add_documents(iterate_input_action iterate_input, put_record_func put_record)
+        // Reader stage (own thread) -> normalize+shingle workers -> writer stage (calling thread).
+        // The writer reorders batches by sequence number, so doc indices and xref do not depend on scheduling.
+        // put_record is only ever called from the calling thread, which is what Lmdb write transactions require.
+        // When put_signature is given, workers also min-hash each document so the signature can be stored next to it.
+        // When put_id is given, doc ids go there (same thread and order as put_record) instead of being kept in xref.
+        // When put_fingerprint is given, it gets the fingerprint of every doc and returns the first doc that had it (the doc
+        // itself when new), so exact duplicates can be recorded against their first copy and left out of grouping.
+        void add_documents(iterate_input_action iterate_input, put_record_func put_record, put_signature_func put_signature = nullptr, put_id_func put_id = nullptr,
+            put_fingerprint_func put_fingerprint = nullptr)
         {
-            doc_id doc_idx{};
-            iterate_input([&](auto docid, auto doctext) {
-                if constexpr (debug_mode)
-                {
-                    if ((doc_idx % 1000) == 0) { std::cout << "Done reading " << doc_idx << "\n"; }
-                }
+            const auto workers_n = std::max<size_t>(1, worker_count);
+            const auto in_flight_max = static_cast<std::ptrdiff_t>(workers_n * 4);
 
-                assert((docid.size() > 0 || doctext.size() > 0) || "doc data is corrupted");
-                if (docid.size() == 0)
+            std::counting_semaphore<> in_flight(in_flight_max);
+            std::atomic<bool> cancelled{};
+            std::atomic<size_t> workers_left{ workers_n };
+            std::exception_ptr reader_error;
+            std::exception_ptr worker_error; // the first one, the others are left out
+            std::mutex worker_error_mtx;
+            work_queue<input_batch> pending;
+            work_queue<shingled_batch> shingled;
+
+            std::jthread reader([&]() {
+                try
                 {
-                    throw std::runtime_error{ "Incorrect doc data." };
-                }
+                    input_batch batch;
+                    auto submit = [&]() {
+                        in_flight.acquire();
+                        if (cancelled)
+                        {
+                            throw std::runtime_error{ "Ingestion cancelled." };
+                        }
+                        const auto seq = batch.seq;
+                        pending.push(std::move(batch));
+                        batch = input_batch{ .seq = seq + 1 };
+                    };
+
+                    iterate_input([&](auto docid, auto doctext) {
+                        assert((docid.size() > 0 || doctext.size() > 0) && "doc data is corrupted");
+                        if (docid.size() == 0)
+                        {
+                            throw std::runtime_error{ "Incorrect doc data." };
+                        }
 
-                if (doctext.size() == 0)
+                        if (doctext.size() == 0)
+                        {
+                            metrics::add(metrics::counter::docs_skipped_empty);
+                            return;
+                        }
+
+                        batch.add(docid, doctext);
+                        if (batch.rows.size() >= batch_size)
+                        {
+                            submit();
+                        }
+                    });
+
+                    if (!batch.rows.empty())
+                    {
+                        submit();
+                    }
+                }
+                catch (...)
                 {
-                    return;
+                    reader_error = std::current_exception();
                 }
+                pending.close();
+            });
 
-                auto added = put_record(doc_idx++, generate_shingles(normalize_text(doctext)));
-                assert(added || "could not insert entry");
+            vector<std::jthread> workers;
+            for (size_t i = 0; i < workers_n; ++i)
+            {
+                workers.emplace_back([&]() {
+                    while (auto batch = pending.pop())
+                    {
+                        if (!cancelled)
+                        {
+                            try
+                            {
+                                shingled.push(process_batch(*batch, static_cast<bool>(put_signature), static_cast<bool>(put_fingerprint)));
+                                continue;
+                            }
+                            catch (...)
+                            {
+                                std::lock_guard lock(worker_error_mtx);
+                                if (!worker_error)
+                                {
+                                    worker_error = std::current_exception();
+                                }
+                                cancelled = true;
+                            }
+                        }
+                        // Keeps the sequence without gaps, the writer stops at the first cancelled batch
+                        shingled.push(shingled_batch{ .seq = batch->seq });
+                    }
+                    if (--workers_left == 0)
+                    {
+                        shingled.close();
+                    }
+                });
+            }
 
-                if (!added)
+            try
+            {
+                std::map<size_t, shingled_batch> out_of_order;
+                size_t next_seq{};
+                while (auto batch = shingled.pop())
                 {
-                    std::cout << "Failed adding item " << (doc_idx - 1) << std::endl;
-                    throw std::runtime_error{ "Lmdb database ran out of space." };
+                    if (cancelled)
+                    {
+                        break;
+                    }
+                    out_of_order.emplace(batch->seq, std::move(*batch));
+                    for (auto it = out_of_order.find(next_seq); it != out_of_order.end(); it = out_of_order.find(++next_seq))
+                    {
+                        write_batch(it->second, put_record, put_signature, put_id, put_fingerprint);
+                        out_of_order.erase(it);
+                        in_flight.release();
+                    }
                 }
+                assert((cancelled || out_of_order.empty()) && "batch sequence has gaps");
+            }
+            catch (...)
+            {
+                cancelled = true;
+                in_flight.release(in_flight_max);
+                throw;
+            }
 
-                xref.emplace_back(docid);
-            });
+            if (cancelled)
+            {
+                in_flight.release(in_flight_max);
+            }
+            reader.join();
+            // A failed worker cancels the reader too, its error is the one that matters
+            if (worker_error)
+            {
+                std::rethrow_exception(worker_error);
+            }
+            if (reader_error)
+            {
+                std::rethrow_exception(reader_error);
+            }
         }
 
         std::string normalize_text(const string_view data) const
@@ -107,6 +336,18 @@ namespace similarity
             return norm;
         }
 
+        // Same shingles as generate_shingles(normalize_text(data)), in one pass and without per-document allocations
+        // once this thread's buffers and out have grown to fit. out is overwritten.
+        void shingle_text(const string_view data, shingle_set& out) const
+        {
+            thread_local kernels::shingle_scratch scratch;
+            kernels::shingle_text(data, out, scratch, window_size, random_seed);
+            if constexpr (debug_mode)
+            {
+                assert(out == generate_shingles(normalize_text(data)));
+            }
+        }
+
         shingle_set generate_shingles(const string_view data) const
         {
             vector<int> whitespaces({ 0 });
@@ -118,8 +359,8 @@ namespace similarity
                 }
             }
 
-            shingle_set shingles(std::max(1, static_cast<int>(whitespaces.size() - shingle_size)));
-            const auto s_size = std::min(shingle_size, whitespaces.size());
+            shingle_set shingles(std::max(1, static_cast<int>(whitespaces.size() - window_size)));
+            const auto s_size = std::min(window_size, whitespaces.size());
             for (size_t i = s_size; i < whitespaces.size(); ++i)
             {
                 auto start = whitespaces[i - s_size];
@@ -138,6 +379,106 @@ namespace similarity
             shingles.erase(std::unique(shingles.begin(), shingles.end()), shingles.end());
             return shingles;
         }
+
+    private:
+        // Rows copied out of the input, ids and texts packed into one buffer per batch.
+        struct input_batch
+        {
+            size_t seq{};
+            std::string data;
+            vector<tuple<size_t, size_t, size_t>> rows; // offset, id length, text length
+
+            void add(string_view docid, string_view doctext)
+            {
+                rows.emplace_back(data.size(), docid.size(), doctext.size());
+                data.append(docid).append(doctext);
+            }
+        };
+
+        // Shingles of all rows back to back, row i owns [offsets[i], offsets[i + 1])
+        struct shingled_batch
+        {
+            size_t seq{};
+            vector<std::string> ids;
+            vector<uint32_t> shingles;
+            vector<size_t> offsets;
+            vector<uint32_t> signatures; // signature_lanes per row
+            vector<doc_fingerprint> fingerprints;
+        };
+
+        shingled_batch process_batch(const input_batch& batch, bool with_signatures, bool with_fingerprints) const
+        {
+            shingled_batch out{ .seq = batch.seq };
+            out.ids.reserve(batch.rows.size());
+            out.shingles.reserve(batch.data.size() / 4); // about a shingle per word
+            out.offsets.reserve(batch.rows.size() + 1);
+            out.offsets.push_back(0);
+            out.signatures.resize(with_signatures ? batch.rows.size() * signature_lanes : 0);
+            out.fingerprints.reserve(with_fingerprints ? batch.rows.size() : 0);
+
+            thread_local shingle_set doc_shingles;
+            const string_view data = batch.data;
+            for (size_t row = 0; row < batch.rows.size(); ++row)
+            {
+                const auto& [offset, id_len, text_len] = batch.rows[row];
+                out.ids.emplace_back(data.substr(offset, id_len));
+                shingle_text(data.substr(offset + id_len, text_len), doc_shingles);
+                out.shingles.insert(out.shingles.end(), doc_shingles.begin(), doc_shingles.end());
+                out.offsets.push_back(out.shingles.size());
+                if (with_signatures)
+                {
+                    minhash_into(doc_shingles, span(out.signatures).subspan(row * signature_lanes, signature_lanes));
+                }
+                if (with_fingerprints)
+                {
+                    out.fingerprints.push_back(fingerprint_of(doc_shingles));
+                }
+            }
+            return out;
+        }
+
+        void write_batch(shingled_batch& batch, const put_record_func& put_record, const put_signature_func& put_signature, const put_id_func& put_id,
+            const put_fingerprint_func& put_fingerprint)
+        {
+            for (size_t i = 0; i < batch.ids.size(); ++i)
+            {
+                const auto doc_idx = static_cast<doc_id>(first_idx + doc_count);
+                if constexpr (debug_mode)
+                {
+                    if ((doc_idx % 1000) == 0) { std::cout << "Done reading " << doc_idx << "\n"; }
+                }
+
+                const auto shingles = shingle_view(batch.shingles).subspan(batch.offsets[i], batch.offsets[i + 1] - batch.offsets[i]);
+                auto added = put_record(doc_idx, shingles);
+                if (added && put_signature)
+                {
+                    added = put_signature(doc_idx, shingle_view(batch.signatures).subspan(i * signature_lanes, signature_lanes));
+                }
+                if (added && put_id)
+                {
+                    added = put_id(doc_idx, batch.ids[i]);
+                }
+                assert(added && "could not insert entry");
+
+                if (!added)
+                {
+                    std::cout << "Failed adding item " << doc_idx << std::endl;
+                    throw std::runtime_error{ "Cache ran out of space." };
+                }
+
+                if (put_fingerprint && put_fingerprint(doc_idx, batch.fingerprints[i]) != doc_idx)
+                {
+                    metrics::add(metrics::counter::docs_exact_duplicates);
+                    ++duplicate_count;
+                }
+
+                if (!put_id)
+                {
+                    xref.push_back(std::move(batch.ids[i]));
+                }
+                ++doc_count;
+            }
+        }
     };
 
     struct lsh_index
@@ -153,8 +494,10 @@ namespace similarity
             bands = band_list(band_cnt);
         }
 
-        vector<doc_id> get_candidates(const minhash_sig& signature) const
+        template<size_t SignatureSize>
+        vector<doc_id> get_candidates(const basic_minhash_sig<SignatureSize>& signature) const
         {
+            assert(static_cast<size_t>(band_cnt * row_cnt) == SignatureSize);
             uint32_t bucket_id{};
             vector<uint32_t> candidates;
             auto docsig = span(signature);
@@ -176,8 +519,10 @@ namespace similarity
             return candidates;
         }
 
-        void add(doc_id id, const minhash_sig& signature)
+        template<size_t SignatureSize>
+        void add(doc_id id, const basic_minhash_sig<SignatureSize>& signature)
         {
+            assert(static_cast<size_t>(band_cnt * row_cnt) == SignatureSize);
             auto docsig = span(signature);
             uint32_t bucket_id{};
             for (int band_id = 0; band_id < bands.size(); ++band_id)
@@ -196,6 +541,277 @@ namespace similarity
                 }
             }
         }
+
+        template<typename TVisit>
+        void for_each_bucket_size(TVisit visit) const
+        {
+            for (const auto& band : bands)
+            {
+                for (const auto& [bucket_id, docs] : band)
+                {
+                    visit(docs.size());
+                }
+            }
+        }
+
+        // An estimate, the node layout of unordered_map is up to the library: a bucket pointer per hash bucket, and per
+        // entry a node with the next pointer, the key and the vector, plus the capacity of the vector
+        size_t memory_usage() const
+        {
+            size_t total = sizeof(*this) + bands.capacity() * sizeof(bucket_list);
+            for (const auto& band : bands)
+            {
+                total += band.bucket_count() * sizeof(void*) + band.size() * (sizeof(void*) + sizeof(bucket_list::value_type));
+                for (const auto& [bucket_id, docs] : band)
+                {
+                    total += docs.capacity() * sizeof(doc_id);
+                }
+            }
+            return total;
+        }
+    };
+
+    // Open-addressing LSH index. Each band is a power-of-two table of (bucket id, head) slots probed linearly,
+    // plus an append-only arena of (doc, next) postings, so adding a doc never allocates a bucket of its own.
+    // All band hashes of a signature are computed in one pass and can be shared between get_candidates and add.
+    struct flat_lsh_index
+    {
+        static constexpr uint32_t no_posting = std::numeric_limits<uint32_t>::max();
+        static constexpr size_t initial_slots = 1024;
+
+        struct slot
+        {
+            uint32_t bucket_id;
+            uint32_t head; // newest posting of the bucket, no_posting for an empty slot
+        };
+
+        struct posting
+        {
+            doc_id id;
+            uint32_t next;
+        };
+
+        // Bucket id of every band of one signature
+        struct band_hashes
+        {
+            array<uint32_t, max_signature_size> bucket_ids{};
+        };
+
+        struct band_table
+        {
+            vector<slot> slots;
+            vector<posting> postings;
+            size_t used{};
+        };
+
+        vector<band_table> bands;
+        int band_cnt{};
+        int row_cnt{};
+
+        flat_lsh_index(const int band_count, const int row_count)
+        {
+            band_cnt = band_count;
+            row_cnt = row_count;
+            bands = vector<band_table>(band_cnt);
+            for (auto& band : bands)
+            {
+                band.slots.assign(initial_slots, slot{ 0, no_posting });
+            }
+        }
+
+        template<size_t SignatureSize>
+        band_hashes hash_bands(const basic_minhash_sig<SignatureSize>& signature) const
+        {
+            assert(static_cast<size_t>(band_cnt * row_cnt) == SignatureSize);
+            band_hashes hashes;
+            for (int band_id = 0; band_id < band_cnt; ++band_id)
+            {
+                hashes.bucket_ids[band_id] = hash_band(signature, band_id);
+            }
+            return hashes;
+        }
+
+        // Bucket id of one band of a signature
+        template<size_t SignatureSize>
+        uint32_t hash_band(const basic_minhash_sig<SignatureSize>& signature, int band_id) const
+        {
+            uint32_t bucket_id{};
+            MurmurHash3_x86_32(signature.data() + band_id * row_cnt, row_cnt * sizeof(uint32_t), band_id, bucket_id);
+            return bucket_id;
+        }
+
+        template<size_t SignatureSize>
+        vector<doc_id> get_candidates(const basic_minhash_sig<SignatureSize>& signature) const
+        {
+            return get_candidates(hash_bands(signature));
+        }
+
+        vector<doc_id> get_candidates(const band_hashes& hashes) const
+        {
+            vector<doc_id> candidates;
+            for (int band_id = 0; band_id < band_cnt; ++band_id)
+            {
+                for_each_in_bucket(band_id, hashes.bucket_ids[band_id], [&](doc_id id) { candidates.push_back(id); });
+            }
+
+            std::sort(candidates.begin(), candidates.end());
+            candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+            return candidates;
+        }
+
+        template<size_t SignatureSize>
+        void add(doc_id id, const basic_minhash_sig<SignatureSize>& signature)
+        {
+            add(id, hash_bands(signature));
+        }
+
+        void add(doc_id id, const band_hashes& hashes)
+        {
+            for (int band_id = 0; band_id < band_cnt; ++band_id)
+            {
+                add_to_band(band_id, id, hashes.bucket_ids[band_id]);
+            }
+        }
+
+        // One band at a time, for users that only keep some of the bands
+        void add_to_band(int band_id, doc_id id, uint32_t bucket_id)
+        {
+            auto& band = bands[band_id];
+            if ((band.used + 1) * 2 > band.slots.size())
+            {
+                grow(band);
+            }
+
+            auto& target = band.slots[find_slot(band, bucket_id)];
+            if (target.head == no_posting)
+            {
+                target.bucket_id = bucket_id;
+                ++band.used;
+            }
+            band.postings.push_back({ id, target.head });
+            target.head = static_cast<uint32_t>(band.postings.size() - 1);
+        }
+
+        // Docs in the bucket of one band, newest first
+        template<typename TVisit>
+        void for_each_in_bucket(int band_id, uint32_t bucket_id, TVisit visit) const
+        {
+            const auto& band = bands[band_id];
+            const auto& found = band.slots[find_slot(band, bucket_id)];
+            for (auto p = found.head; p != no_posting; p = band.postings[p].next)
+            {
+                visit(band.postings[p].id);
+            }
+        }
+
+        // Flat dump of the band tables: counts first, then the raw slot and posting arrays of each band.
+        void save(std::ostream& out) const
+        {
+            const uint64_t header[] = { static_cast<uint64_t>(band_cnt), static_cast<uint64_t>(row_cnt) };
+            out.write(reinterpret_cast<const char*>(header), sizeof(header));
+            for (const auto& band : bands)
+            {
+                save_band(out, band);
+            }
+        }
+
+        static flat_lsh_index load(std::istream& in)
+        {
+            uint64_t header[2]{};
+            in.read(reinterpret_cast<char*>(header), sizeof(header));
+            flat_lsh_index index(static_cast<int>(header[0]), static_cast<int>(header[1]));
+            for (auto& band : index.bands)
+            {
+                load_band(in, band);
+            }
+
+            if (!in)
+            {
+                throw std::runtime_error{ "Lsh index file is truncated." };
+            }
+            return index;
+        }
+
+        // The part of save for a single band
+        static void save_band(std::ostream& out, const band_table& band)
+        {
+            const uint64_t sizes[] = { band.slots.size(), band.postings.size(), band.used };
+            out.write(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+            out.write(reinterpret_cast<const char*>(band.slots.data()), band.slots.size() * sizeof(slot));
+            out.write(reinterpret_cast<const char*>(band.postings.data()), band.postings.size() * sizeof(posting));
+        }
+
+        static void load_band(std::istream& in, band_table& band)
+        {
+            uint64_t sizes[3]{};
+            in.read(reinterpret_cast<char*>(sizes), sizeof(sizes));
+            band.slots.resize(sizes[0]);
+            band.postings.resize(sizes[1]);
+            band.used = sizes[2];
+            in.read(reinterpret_cast<char*>(band.slots.data()), band.slots.size() * sizeof(slot));
+            in.read(reinterpret_cast<char*>(band.postings.data()), band.postings.size() * sizeof(posting));
+        }
+
+        template<typename TVisit>
+        void for_each_bucket_size(TVisit visit) const
+        {
+            for (const auto& band : bands)
+            {
+                for_each_bucket_size(band, visit);
+            }
+        }
+
+        template<typename TVisit>
+        static void for_each_bucket_size(const band_table& band, TVisit visit)
+        {
+            for (const auto& s : band.slots)
+            {
+                size_t size{};
+                for (auto p = s.head; p != no_posting; p = band.postings[p].next)
+                {
+                    ++size;
+                }
+                if (size) visit(size);
+            }
+        }
+
+        size_t memory_usage() const
+        {
+            size_t total = sizeof(*this) + bands.capacity() * sizeof(band_table);
+            for (const auto& band : bands)
+            {
+                total += band.slots.capacity() * sizeof(slot) + band.postings.capacity() * sizeof(posting);
+            }
+            return total;
+        }
+
+    private:
+        // Slot holding bucket_id, or the empty slot where it would go.
+        static size_t find_slot(const band_table& band, uint32_t bucket_id)
+        {
+            const size_t mask = band.slots.size() - 1;
+            for (size_t i = bucket_id & mask;; i = (i + 1) & mask)
+            {
+                const auto& s = band.slots[i];
+                if (s.head == no_posting || s.bucket_id == bucket_id)
+                {
+                    return i;
+                }
+            }
+        }
+
+        static void grow(band_table& band)
+        {
+            auto old_slots = std::move(band.slots);
+            band.slots.assign(old_slots.size() * 2, slot{ 0, no_posting });
+            for (const auto& s : old_slots)
+            {
+                if (s.head != no_posting)
+                {
+                    band.slots[find_slot(band, s.bucket_id)] = s;
+                }
+            }
+        }
     };
 
     inline auto lsh_threshold(int bands, int rows)
@@ -229,121 +845,383 @@ namespace similarity
         return { bands, sig_size / bands };
     }
 
+    // Jaccard index of two sorted, duplicate-free shingle sets. With a threshold the intersection may stop early,
+    // the returned score is then only guaranteed to be below that threshold.
     template<typename Cont>
-    inline float calculate_similarity(const Cont a, const Cont b)
+    inline float calculate_similarity(const Cont a, const Cont b, const float threshold = 0.0f)
     {
-        int intersect_cnt{};
-        for (const auto& item_a : a)
-        {
-            if (std::find(b.begin(), b.end(), item_a) != b.end())
-            {
-                ++intersect_cnt;
-            }
-        }
-        const int union_cnt = a.size() + b.size() - intersect_cnt;
+        assert(std::is_sorted(a.begin(), a.end()) && std::is_sorted(b.begin(), b.end()));
+        const auto min_required = kernels::min_intersection_for(a.size(), b.size(), threshold);
+        const auto intersect_cnt = kernels::intersect_count(a, b, min_required);
+        const auto union_cnt = a.size() + b.size() - intersect_cnt;
         return static_cast<float>(intersect_cnt) / union_cnt;
     }
 
 
-    const minhash_sig minhash(shingle_view shingles)
+    // Candidates as the index returns them (by doc id) into the order they are checked in, largest first. Anything
+    // replaying grouping has to order them the same way for ties to go the same way.
+    inline void order_candidates(vector<doc_id>& candidates, const vector<size_t>& doc_size_xref)
     {
-        static const auto coeffs = []()
+        assert(std::is_sorted(candidates.begin(), candidates.end()));
+        std::sort(candidates.begin(), candidates.end(), [&doc_size_xref](const doc_id& a, const doc_id& b) { return doc_size_xref[a] > doc_size_xref[b]; });
+    }
+
+    // Groups docs in the given order: each doc joins the group of the best verified representative the index
+    // returns, or becomes a representative itself and goes into the index. assign(doc, representative, score) is
+    // called for every doc in order, a new representative is reported as its own with a score of 1.
+    // With thread_count > 1 documents are verified speculatively in parallel batches and committed in order,
+    // producing the same groups as the sequential scan.
+    // Candidates are prefiltered on their min-hash estimate first (see prefilter_margin). stored_signature_of(doc)
+    // points to the signature of a representative wherever the caller keeps it, so none are copied here, or is null;
+    // representatives it has none for (e.g. those of earlier runs) are always verified exactly.
+    // The records of the candidates left are fetched with one seek_many per doc.
+    template<typename TLshIndex, record_store TRecords, typename TSignatureOf, typename TStoredSignatureOf, typename TAssign>
+    void assign_near_dupes(TLshIndex& lsh, span<const doc_id> docs, const vector<size_t>& doc_size_xref, const TRecords& records,
+        const float similarity_threshold, TSignatureOf signature_of, TStoredSignatureOf stored_signature_of, size_t thread_count, TAssign assign)
+    {
+        using signature_type = std::decay_t<decltype(signature_of(doc_id{}, shingle_view{}))>;
+
+        // What the index is queried with: precomputed band hashes when the index supports them, the signature otherwise
+        auto band_key = [&](const signature_type& signature) {
+            if constexpr (requires { lsh.hash_bands(signature); }) { return lsh.hash_bands(signature); }
+            else { return signature; }
+        };
+
+        auto sorted_candidates = [&](const auto& key) {
+            auto candidates = lsh.get_candidates(key);
+            order_candidates(candidates, doc_size_xref);
+            return candidates;
+        };
+
+        const float prefilter_cutoff = similarity_threshold - prefilter_margin();
+        auto prefiltered = [&](const signature_type& signature_a, doc_id doc_b) {
+            if (prefilter_cutoff <= 0)
+            {
+                return false;
+            }
+            const signature_type* signature_b = stored_signature_of(doc_b);
+            return signature_b && estimate_similarity(signature_a, *signature_b) < prefilter_cutoff;
+        };
+
+        // Candidates worth a Jaccard check, in order. Returns how many the prefilter dropped.
+        auto select_candidates = [&](doc_id doc_a, const signature_type& signature_a, const vector<doc_id>& candidates, vector<doc_id>& selected) {
+            selected.clear();
+            size_t skipped{};
+            for (const auto& doc_b : candidates)
+            {
+                if ((static_cast<float>(doc_size_xref[doc_a]) / doc_size_xref[doc_b]) < similarity_threshold)
+                {
+                    break; // this one and next candidates are too small
+                }
+                if (prefiltered(signature_a, doc_b))
+                {
+                    ++skipped; // saves the record lookup and the Jaccard check
+                    continue;
+                }
+                selected.push_back(doc_b);
+            }
+            return skipped;
+        };
+
+        // score_of(i, bound) scores selected[i] and may stop early and return anything below bound. The bound is the
+        // threshold rather than the best score so far: every score reaching the threshold is exact, which makes matched
+        // the same however the scan runs (sequential, speculative or partitioned) at the cost of finishing a few
+        // intersections that could have stopped below an earlier best.
+        // Metrics are recorded once per doc, by the pass whose result is committed (record).
+        auto pick_best = [&](doc_id doc_a, size_t returned, size_t skipped, const vector<doc_id>& selected, auto&& score_of, bool record) {
+            float best_score{};
+            doc_id best_match{};
+            size_t matched{};
+            for (size_t i = 0; i < selected.size(); ++i)
+            {
+                const auto score = score_of(i, similarity_threshold);
+                matched += score >= similarity_threshold;
+                if (score > best_score)
+                {
+                    best_score = score;
+                    best_match = selected[i];
+                }
+            }
+
+            if constexpr (metrics::enabled)
+            {
+                if (record)
+                {
+                    metrics::add(metrics::counter::lsh_queries);
+                    metrics::add(metrics::counter::lsh_candidates, returned);
+                    metrics::add(metrics::counter::candidates_size_pruned, returned - selected.size() - skipped);
+                    metrics::add(metrics::counter::candidates_prefiltered, skipped);
+                    metrics::add(metrics::counter::candidates_verified, selected.size());
+                    metrics::add(metrics::counter::candidates_matched, matched);
+                    metrics::observe(metrics::histogram_kind::candidates_per_query, returned);
+                    metrics::observe(metrics::histogram_kind::shingles_per_doc, doc_size_xref[doc_a]);
+                }
+            }
+            return pair{ best_score, best_match };
+        };
+
+        auto commit = [&](doc_id doc_a, const auto& key, float best_score, doc_id best_match) {
+            if (best_score >= similarity_threshold)
+            {
+                assign(doc_a, best_match, best_score);
+            }
+            else
+            {
+                lsh.add(doc_a, key);
+                assign(doc_a, doc_a, 1.0f);
+            }
+        };
+
+        if (thread_count <= 1)
         {
-            std::mt19937 rng{ random_seed };
-            std::uniform_int_distribution<uint32_t> uint_dist;
-            array<uint32_t, signature_size> coeffs;
-            std::generate(coeffs.begin(), coeffs.end(), [&]() { return uint_dist(rng); });
-            return coeffs;
-        }();
+            vector<doc_id> selected;
+            vector<shingle_view> selected_records;
+            for (const auto& doc_a : docs)
+            {
+                const auto shingles_a = records.seek(doc_a);
+                assert(!shingles_a.empty());
+                const signature_type signature = signature_of(doc_a, shingles_a);
+                const auto key = band_key(signature);
+
+                const auto candidates = sorted_candidates(key);
+                const auto skipped = select_candidates(doc_a, signature, candidates, selected);
+                records.seek_many(selected, selected_records);
+                const auto [best_score, best_match] = pick_best(doc_a, candidates.size(), skipped, selected, [&](size_t i, float bound) {
+                    assert(!selected_records[i].empty());
+                    return calculate_similarity(shingles_a, selected_records[i], bound);
+                }, true);
+                commit(doc_a, key, best_score, best_match);
+            }
+            return;
+        }
+
+        // Speculation: every doc of a batch is checked against the index as it was before the batch and keeps
+        // the exact scores of candidates reaching the threshold. Commit: docs are replayed in order against the
+        // live index, only representatives added earlier in the same batch still need a Jaccard check.
+        struct speculation
+        {
+            signature_type signature;
+            std::decay_t<decltype(band_key(signature_type{}))> key;
+            vector<pair<doc_id, float>> verified;
+        };
 
-        size_t int_ctr{};
-        minhash_sig sig;
+        thread_pool pool(thread_count);
+        const size_t batch_size = pool.size() * 16;
+        vector<speculation> batch(batch_size);
+        vector<uint8_t> added_in_batch(doc_size_xref.size());
+        vector<doc_id> batch_reps;
+        vector<doc_id> selected;
 
-        if constexpr (is_using_msvc)
+        for (size_t begin = 0; begin < docs.size(); begin += batch_size)
         {
-            for (int i = 0; i < sig.size(); ++i)
+            const auto batch_docs = docs.subspan(begin, std::min(batch_size, docs.size() - begin));
+
+            pool.run(batch_docs.size(), [&](size_t i) {
+                thread_local vector<doc_id> spec_selected;
+                thread_local vector<shingle_view> spec_records;
+                const auto doc_a = batch_docs[i];
+                const auto shingles_a = records.seek(doc_a);
+                assert(!shingles_a.empty());
+
+                auto& spec = batch[i];
+                spec.signature = signature_of(doc_a, shingles_a);
+                spec.key = band_key(spec.signature);
+                spec.verified.clear();
+
+                const auto candidates = sorted_candidates(spec.key);
+                const auto skipped = select_candidates(doc_a, spec.signature, candidates, spec_selected);
+                records.seek_many(spec_selected, spec_records);
+                pick_best(doc_a, candidates.size(), skipped, spec_selected, [&](size_t j, float) {
+                    assert(!spec_records[j].empty());
+                    const auto score = calculate_similarity(shingles_a, spec_records[j], similarity_threshold);
+                    if (score >= similarity_threshold)
+                    {
+                        spec.verified.emplace_back(spec_selected[j], score);
+                    }
+                    return score;
+                }, false);
+            });
+
+            for (size_t i = 0; i < batch_docs.size(); ++i)
             {
-                uint32_t min = std::numeric_limits<uint32_t>::max();
-                for (int j = 0; j < shingles.size(); ++j)
+                const auto doc_a = batch_docs[i];
+                const auto& spec = batch[i];
+                shingle_view shingles_a;
+
+                const auto candidates = sorted_candidates(spec.key);
+                const auto skipped = select_candidates(doc_a, spec.signature, candidates, selected);
+                const auto [best_score, best_match] = pick_best(doc_a, candidates.size(), skipped, selected, [&](size_t j, float bound) -> float {
+                    const auto doc_b = selected[j];
+                    if (added_in_batch[doc_b])
+                    {
+                        if (shingles_a.empty()) shingles_a = records.seek(doc_a);
+                        return calculate_similarity(shingles_a, records.seek(doc_b), bound);
+                    }
+
+                    const auto found = std::find_if(spec.verified.begin(), spec.verified.end(), [&](const auto& v) { return v.first == doc_b; });
+                    return found != spec.verified.end() ? found->second : 0.0f; // not kept means below the threshold
+                }, true);
+
+                if (best_score < similarity_threshold)
                 {
-                    uint32_t a = shingles[j] ^ coeffs[i];
-                    if (a < min) min = a;
+                    added_in_batch[doc_a] = 1;
+                    batch_reps.push_back(doc_a);
                 }
-                sig[i] = min;
+                commit(doc_a, spec.key, best_score, best_match);
+            }
+
+            for (const auto doc : batch_reps)
+            {
+                added_in_batch[doc] = 0;
             }
+            batch_reps.clear();
+        }
+    }
+
+    inline void add_to_groups(nd_groups& groups, doc_id doc, doc_id representative, float score)
+    {
+        if (doc == representative)
+        {
+            groups.emplace(doc, vector<pair<doc_id, float>>());
         }
         else
         {
-            std::generate(sig.begin(), sig.end(), [&int_ctr, &shingles]() {
-                const auto& xor_coeff = coeffs[int_ctr++];
-                return std::reduce(shingles.begin(), shingles.end(), std::numeric_limits<uint32_t>::max(), [&xor_coeff](auto min, auto hash) {
-                    return std::min(min, hash ^ xor_coeff);
-                    });
-                });
+            groups[representative].emplace_back(doc, score);
         }
+    }
 
-        return sig;
+    template<typename TLshIndex>
+    void print_lsh_setup(const TLshIndex& lsh, const float similarity_threshold)
+    {
+        std::cout << "Using " << lsh.band_cnt << " bands and " << lsh.row_cnt << " rows of " << lsh.band_cnt * lsh.row_cnt << "-lane signatures" << std::endl;
+        std::cout << "Using " << kernels::isa_name(kernels::selected_isa()) << " min-hash kernel" << std::endl;
+        std::cout << "About " << std::setprecision(2) << (lsh_false_negatives_prob(lsh.band_cnt, lsh.row_cnt, similarity_threshold) * 100) << "% of the " << similarity_threshold * 100 << "%-similar pairs will be false negatives " << std::endl;
+        std::cout << "We should find " << std::setprecision(2) << (lsh_cp_probability(lsh.band_cnt, lsh.row_cnt, similarity_threshold) * 100) << "% pairs of truly similar documents" << std::endl;
     }
 
-    template<typename TLshIndex = lsh_index>
-    nd_groups find_near_dupes(iterate_records_action iterate_records, size_t record_count, seek_record_func seek_record, const float similarity_threshold)
+    template<typename TLshIndex>
+    void observe_bucket_sizes(const TLshIndex& lsh)
     {
-        auto [band_cnt, row_cnt] = lsh_bands_n_rows(signature_size, similarity_threshold);
-        TLshIndex lsh(band_cnt, row_cnt);
+        if constexpr (metrics::enabled)
+        {
+            lsh.for_each_bucket_size([](size_t size) { metrics::observe(metrics::histogram_kind::bucket_size, size); });
+        }
+    }
 
-        std::cout << "Using " << band_cnt << " bands and " << row_cnt << " rows" << std::endl;
-        std::cout << "About " << std::setprecision(2) << (lsh_false_negatives_prob(band_cnt, row_cnt, similarity_threshold) * 100) << "% of the " << similarity_threshold * 100 << "%-similar pairs will be false negatives " << std::endl;
-        std::cout << "We should find " << std::setprecision(2) << (lsh_cp_probability(band_cnt, row_cnt, similarity_threshold) * 100) << "% pairs of truly similar documents" << std::endl;
+    // Signatures stored at ingestion can be passed in (indexed by doc id) to skip recomputing them.
+    // The index is filled with the representatives, so it can be kept for later incremental runs.
+    template<size_t SignatureSize = signature_size, typename TLshIndex, record_store TRecords>
+    nd_groups find_near_dupes(TLshIndex& lsh, const TRecords& records, size_t record_count, const float similarity_threshold,
+        std::type_identity_t<span<const basic_minhash_sig<SignatureSize>>> signatures = {}, size_t thread_count = 1)
+    {
+        assert(signatures.empty() || signatures.size() == record_count);
+        print_lsh_setup(lsh, similarity_threshold);
 
         vector<size_t> doc_size_xref(record_count);
-        iterate_records([&, i = 0](auto idx, auto shingles) mutable { doc_size_xref.at(i++) = static_cast<uint32_t>(shingles.size()); });
+        records.for_each([&, i = 0](auto idx, auto shingles) mutable { doc_size_xref.at(i++) = static_cast<uint32_t>(shingles.size()); });
 
         vector<doc_id> docs_by_size_desc(record_count);
         std::generate(docs_by_size_desc.begin(), docs_by_size_desc.end(), [i = 0]() mutable { return i++; });
         auto sort_by_size_desc = [&doc_size_xref](const doc_id& a, const doc_id& b) -> bool { return doc_size_xref[a] > doc_size_xref[b]; };
         std::sort(docs_by_size_desc.begin(), docs_by_size_desc.end(), sort_by_size_desc);
 
+        auto signature_of = [&](doc_id doc, shingle_view shingles) { return signatures.empty() ? minhash<SignatureSize>(shingles) : signatures[doc]; };
+        auto stored_signature_of = [&](doc_id doc) -> const basic_minhash_sig<SignatureSize>* {
+            return signatures.empty() ? nullptr : &signatures[doc]; // nothing to prefilter on without stored signatures
+        };
+
         nd_groups groups;
-        for (const auto& doc_a : docs_by_size_desc)
-        {
-            float best_score{};
-            doc_id best_match{};
+        assign_near_dupes(lsh, span<const doc_id>(docs_by_size_desc), doc_size_xref, records, similarity_threshold, signature_of, stored_signature_of, thread_count,
+            [&](doc_id doc, doc_id representative, float score) { add_to_groups(groups, doc, representative, score); });
+        observe_bucket_sizes(lsh);
+        return groups;
+    }
 
-            const auto shingles_a = seek_record(doc_a);
-            assert(!shingles_a.empty());
-            const auto signature = minhash(shingles_a);
-            auto candidates = lsh.get_candidates(signature);
-            std::sort(candidates.begin(), candidates.end(), sort_by_size_desc);
+    template<size_t SignatureSize = signature_size, typename TLshIndex = flat_lsh_index, record_store TRecords>
+    nd_groups find_near_dupes(const TRecords& records, size_t record_count, const float similarity_threshold,
+        std::type_identity_t<span<const basic_minhash_sig<SignatureSize>>> signatures = {}, size_t thread_count = 1)
+    {
+        auto [band_cnt, row_cnt] = lsh_bands_n_rows(SignatureSize, similarity_threshold);
+        TLshIndex lsh(band_cnt, row_cnt);
+        return find_near_dupes<SignatureSize>(lsh, records, record_count, similarity_threshold, signatures, thread_count);
+    }
 
-            for (const auto& doc_b : candidates)
-            {
-                if ((static_cast<float>(doc_size_xref[doc_a]) / doc_size_xref[doc_b]) < similarity_threshold)
-                {
-                    break; // this one and next candidates are too small
-                }
+    // Incremental run: groups docs [first_new, first_new + new_signatures.size()) against an index kept from earlier runs.
+    // doc_size_xref holds the shingle count of every doc, old and new. Only the new docs are read, signed and verified,
+    // old docs are only touched when they come back as candidates. Returns the groups the new docs joined or started.
+    template<size_t SignatureSize = signature_size, typename TLshIndex, record_store TRecords>
+    nd_groups add_near_dupes(TLshIndex& lsh, const vector<size_t>& doc_size_xref, doc_id first_new, std::type_identity_t<span<const basic_minhash_sig<SignatureSize>>> new_signatures,
+        const TRecords& records, const float similarity_threshold, size_t thread_count = 1)
+    {
+        assert(first_new + new_signatures.size() == doc_size_xref.size());
+        print_lsh_setup(lsh, similarity_threshold);
 
-                const auto shingles_b = seek_record(doc_b);
-                assert(!shingles_b.empty());
+        vector<doc_id> new_docs_by_size_desc(new_signatures.size());
+        std::generate(new_docs_by_size_desc.begin(), new_docs_by_size_desc.end(), [i = first_new]() mutable { return i++; });
+        std::sort(new_docs_by_size_desc.begin(), new_docs_by_size_desc.end(), [&doc_size_xref](const doc_id& a, const doc_id& b) { return doc_size_xref[a] > doc_size_xref[b]; });
 
-                const auto score = calculate_similarity(shingles_a, shingles_b);
-                if (score > best_score)
-                {
-                    best_score = score;
-                    best_match = doc_b;
-                }
-            }
+        auto signature_of = [&](doc_id doc, shingle_view) { return new_signatures[doc - first_new]; };
+        auto stored_signature_of = [&](doc_id doc) -> const basic_minhash_sig<SignatureSize>* {
+            return doc < first_new ? nullptr : &new_signatures[doc - first_new];
+        };
 
-            if (best_score >= similarity_threshold)
+        nd_groups groups;
+        assign_near_dupes(lsh, span<const doc_id>(new_docs_by_size_desc), doc_size_xref, records, similarity_threshold, signature_of, stored_signature_of, thread_count,
+            [&](doc_id doc, doc_id representative, float score) { add_to_groups(groups, doc, representative, score); });
+        observe_bucket_sizes(lsh);
+        return groups;
+    }
+
+    // Docs [first_doc, doc_size_xref.size()) in the order stream_near_dupes groups them: largest first, with only the
+    // first copy of exact duplicates, see stream_near_dupes.
+    inline vector<doc_id> grouping_order(const vector<size_t>& doc_size_xref, doc_id first_doc, span<const pair<doc_id, doc_id>> duplicates = {})
+    {
+        vector<doc_id> docs_by_size_desc(doc_size_xref.size() - first_doc);
+        std::generate(docs_by_size_desc.begin(), docs_by_size_desc.end(), [i = first_doc]() mutable { return i++; });
+        std::sort(docs_by_size_desc.begin(), docs_by_size_desc.end(), [&doc_size_xref](const doc_id& a, const doc_id& b) { return doc_size_xref[a] > doc_size_xref[b]; });
+
+        // Copies share a size, so the first copy takes the place of whichever copy sorted first and the others drop out.
+        // Groups come out as if every copy had been checked.
+        if (!duplicates.empty())
+        {
+            vector<doc_id> first_copy(docs_by_size_desc.size());
+            std::generate(first_copy.begin(), first_copy.end(), [i = first_doc]() mutable { return i++; });
+            for (const auto& [duplicate, original] : duplicates)
             {
-                groups[best_match].emplace_back(doc_a, best_score);
+                first_copy.at(duplicate - first_doc) = original;
             }
-            else
+
+            vector<uint8_t> placed(docs_by_size_desc.size());
+            size_t kept{};
+            for (const auto doc : docs_by_size_desc)
             {
-                lsh.add(doc_a, signature);
-                groups.emplace(doc_a, vector<pair<doc_id, float>>());
+                const auto original = first_copy[doc - first_doc];
+                if (original < first_doc || placed[original - first_doc])
+                {
+                    continue; // grouped in an earlier run, or already in place
+                }
+                placed[original - first_doc] = 1;
+                docs_by_size_desc[kept++] = original;
             }
+            docs_by_size_desc.resize(kept);
         }
+        return docs_by_size_desc;
+    }
 
-        return groups;
+    // Groups docs [first_doc, doc_size_xref.size()) and hands every assignment to assign as it is committed instead of
+    // collecting groups in memory. signature_of, stored_signature_of and assign are as in assign_near_dupes, both
+    // signature accessors have to answer for docs from first_doc on.
+    // A full run passes first_doc 0 and an empty index, an incremental run the index kept from earlier runs.
+    // duplicates holds (exact duplicate, its first copy) pairs found at ingestion. Copies are left out of grouping and
+    // assigned by the caller to the group of their first copy.
+    template<typename TLshIndex, record_store TRecords, typename TSignatureOf, typename TStoredSignatureOf, typename TAssign>
+    void stream_near_dupes(TLshIndex& lsh, const vector<size_t>& doc_size_xref, doc_id first_doc, const TRecords& records,
+        TSignatureOf signature_of, TStoredSignatureOf stored_signature_of, const float similarity_threshold, size_t thread_count, TAssign assign,
+        span<const pair<doc_id, doc_id>> duplicates = {})
+    {
+        print_lsh_setup(lsh, similarity_threshold);
+        const auto docs_by_size_desc = grouping_order(doc_size_xref, first_doc, duplicates);
+        assign_near_dupes(lsh, span<const doc_id>(docs_by_size_desc), doc_size_xref, records, similarity_threshold, signature_of, stored_signature_of, thread_count, assign);
+        observe_bucket_sizes(lsh);
     }
 }
\ No newline at end of file
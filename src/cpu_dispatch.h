@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdlib>
+#include <algorithm>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define NDD_X86_64 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(NDD_X86_64) && (defined(__GNUC__) || defined(__clang__))
+#define NDD_TARGET_AVX2 __attribute__((target("avx2")))
+#define NDD_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define NDD_TARGET_AVX2
+#define NDD_TARGET_AVX512
+#endif
+
+namespace similarity::kernels
+{
+    enum class isa { scalar, avx2, avx512 };
+
+    inline const char* isa_name(isa level)
+    {
+        switch (level)
+        {
+        case isa::avx512: return "avx512";
+        case isa::avx2: return "avx2";
+        default: return "scalar";
+        }
+    }
+
+    inline isa detect_isa()
+    {
+#ifdef NDD_X86_64
+#if defined(_MSC_VER)
+        int info[4]{};
+        __cpuid(info, 0);
+        if (info[0] < 7) return isa::scalar;
+        __cpuid(info, 1);
+        const bool os_saves_ymm = (info[2] & (1 << 27)) && ((_xgetbv(0) & 0x6) == 0x6);
+        if (!os_saves_ymm) return isa::scalar;
+        __cpuidex(info, 7, 0);
+        const bool has_avx2 = info[1] & (1 << 5);
+        const bool has_avx512 = (info[1] & (1 << 16)) && ((_xgetbv(0) & 0xe6) == 0xe6);
+        return has_avx512 ? isa::avx512 : has_avx2 ? isa::avx2 : isa::scalar;
+#else
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return isa::avx512;
+        if (__builtin_cpu_supports("avx2")) return isa::avx2;
+#endif
+#endif
+        return isa::scalar;
+    }
+
+    // Highest supported level, optionally capped through an environment variable set to scalar|avx2|avx512.
+    inline isa capped_isa(const char* env_var)
+    {
+        auto level = detect_isa();
+        if (const char* cap = std::getenv(env_var))
+        {
+            const std::string_view requested{ cap };
+            const auto wanted = requested == "avx512" ? isa::avx512 : requested == "avx2" ? isa::avx2 : isa::scalar;
+            level = std::min(level, wanted);
+        }
+        return level;
+    }
+}
@@ -0,0 +1,259 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <span>
+#include <optional>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include "core.h"
+#include "input.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Record store for dense doc ids written once in order and then only read, which needs no B-tree: the shingle sets of
+// docs 0..n-1 go back to back into <name>.dat and the end offset of each into <name>.idx, both append-only, and a
+// seek is two offset reads into the mapped files. What is committed is a commit record the owner of the store keeps,
+// in the transaction that commits what belongs to the same docs (see flat_record_writer::sync), so a crash leaves the
+// store as of the last commit; anything appended after it is cut off when the store is opened for writing again.
+// The empty <name>.meta only marks that the store exists.
+namespace similarity::flat_store
+{
+    struct commit_record
+    {
+        uint64_t magic;
+        uint64_t doc_count;
+        uint64_t data_words; // shingles in <name>.dat
+    };
+
+    constexpr uint64_t commit_magic = 0x31'4c'46'44'44'4e; // "NDDFL1"
+
+    inline std::filesystem::path path_of(const std::filesystem::path& dir, const std::string& name, const char* extension)
+    {
+        return dir / (name + extension);
+    }
+
+    inline bool exists(const std::filesystem::path& dir, const std::string& name = "shingles")
+    {
+        return std::filesystem::exists(path_of(dir, name, ".meta"));
+    }
+
+    // The commit record covering the first doc_count docs of the store, to cut it back to them
+    inline commit_record commit_at(const std::filesystem::path& dir, uint64_t doc_count, const std::string& name = "shingles")
+    {
+        commit_record committed{ commit_magic, doc_count, 0 };
+        if (doc_count == 0)
+        {
+            return committed;
+        }
+
+        std::ifstream index(path_of(dir, name, ".idx"), std::ios::binary);
+        index.seekg(static_cast<std::streamoff>((doc_count - 1) * sizeof(uint64_t)));
+        if (!index.read(reinterpret_cast<char*>(&committed.data_words), sizeof(uint64_t)))
+        {
+            throw std::runtime_error{ "Flat store " + name + " is shorter than committed, remove the cache to rebuild it." };
+        }
+        return committed;
+    }
+
+    // Flushes the stdio buffer and makes the OS write the file out
+    inline bool sync(std::FILE* file)
+    {
+        if (std::fflush(file) != 0)
+        {
+            return false;
+        }
+#ifdef _WIN32
+        return _commit(_fileno(file)) == 0;
+#else
+        return ::fsync(::fileno(file)) == 0;
+#endif
+    }
+
+    // A rename is only durable once the directory entry is
+    inline void sync_dir(const std::filesystem::path& dir)
+    {
+#ifndef _WIN32
+        const int fd = ::open(dir.c_str(), O_RDONLY);
+        if (fd >= 0)
+        {
+            ::fsync(fd);
+            ::close(fd);
+        }
+#endif
+    }
+}
+
+namespace similarity
+{
+    // Appends records, put has the shape of put_record_func. Nothing is visible to readers before the commit record
+    // sync returns is stored.
+    class flat_record_writer
+    {
+        std::string name;
+        std::FILE* data{};
+        std::FILE* index{};
+        uint64_t doc_count{};
+        uint64_t data_words{};
+
+        static std::FILE* open_at(const std::filesystem::path& path, uint64_t bytes)
+        {
+            // Drops what an interrupted run appended after the last commit
+            if (!std::filesystem::exists(path))
+            {
+                std::fclose(std::fopen(path.string().c_str(), "wb"));
+            }
+            if (std::filesystem::file_size(path) < bytes)
+            {
+                throw std::runtime_error{ "Flat store file " + path.string() + " is shorter than committed, remove the cache to rebuild it." };
+            }
+            std::filesystem::resize_file(path, bytes);
+
+            std::FILE* file = std::fopen(path.string().c_str(), "ab");
+            if (!file)
+            {
+                throw std::runtime_error{ "Could not open " + path.string() };
+            }
+            std::setvbuf(file, nullptr, _IOFBF, 1 << 20);
+            return file;
+        }
+
+    public:
+        // Starts from the last commit record, { commit_magic, 0, 0 } for a new store, cutting off whatever was appended
+        // after it
+        flat_record_writer(const std::filesystem::path& dir, const flat_store::commit_record& committed, const std::string& name = "shingles") : name(name)
+        {
+            doc_count = committed.doc_count;
+            data_words = committed.data_words;
+            data = open_at(flat_store::path_of(dir, name, ".dat"), data_words * sizeof(uint32_t));
+            index = open_at(flat_store::path_of(dir, name, ".idx"), doc_count * sizeof(uint64_t));
+            if (!flat_store::exists(dir, name))
+            {
+                std::FILE* meta = std::fopen(flat_store::path_of(dir, name, ".meta").string().c_str(), "wb");
+                if (!meta || std::fclose(meta) != 0)
+                {
+                    throw std::runtime_error{ "Could not create flat store " + name + "." };
+                }
+                flat_store::sync_dir(dir);
+            }
+        }
+
+        // Uncommitted records are left behind and cut off by the next writer
+        ~flat_record_writer()
+        {
+            std::fclose(data);
+            std::fclose(index);
+        }
+
+        flat_record_writer(const flat_record_writer&) = delete;
+        flat_record_writer& operator=(const flat_record_writer&) = delete;
+
+        size_t size() const
+        {
+            return doc_count;
+        }
+
+        bool put(doc_id doc, shingle_view shingles)
+        {
+            if (doc != doc_count)
+            {
+                throw std::runtime_error{ "Flat store doc ids must be dense and added in order." };
+            }
+            if (std::fwrite(shingles.data(), sizeof(uint32_t), shingles.size(), data) != shingles.size())
+            {
+                return false;
+            }
+
+            const auto end = data_words + shingles.size();
+            if (std::fwrite(&end, sizeof(uint64_t), 1, index) != 1)
+            {
+                return false;
+            }
+            data_words = end;
+            ++doc_count;
+            return true;
+        }
+
+        // Makes the records put so far durable and returns the commit record covering them. They are committed once the
+        // caller stores the record, e.g. in the transaction that commits what belongs to the same docs.
+        flat_store::commit_record sync()
+        {
+            if (!flat_store::sync(data) || !flat_store::sync(index))
+            {
+                throw std::runtime_error{ "Could not sync flat store " + name + "." };
+            }
+            return { flat_store::commit_magic, doc_count, data_words };
+        }
+    };
+
+    // Reads the committed records of a flat store, any thread may seek. Records point into the mapping and stay valid
+    // while the store does. Records committed after it was opened are not seen.
+    class flat_record_store
+    {
+        std::optional<input::mapped_file> data_file, index_file;
+        span<const uint32_t> words;
+        span<const uint64_t> ends;
+
+    public:
+        // The records covered by a commit record flat_record_writer::sync returned
+        flat_record_store(const std::filesystem::path& dir, const flat_store::commit_record& committed, const std::string& name = "shingles")
+        {
+            if (committed.doc_count == 0)
+            {
+                return;
+            }
+
+            data_file.emplace(flat_store::path_of(dir, name, ".dat"), false);
+            index_file.emplace(flat_store::path_of(dir, name, ".idx"), false);
+            const auto data = data_file->view();
+            const auto index = index_file->view();
+            if (data.size() < committed.data_words * sizeof(uint32_t) || index.size() < committed.doc_count * sizeof(uint64_t))
+            {
+                throw std::runtime_error{ "Flat store " + name + " is shorter than committed, remove the cache to rebuild it." };
+            }
+            words = { reinterpret_cast<const uint32_t*>(data.data()), committed.data_words };
+            ends = { reinterpret_cast<const uint64_t*>(index.data()), committed.doc_count };
+        }
+
+        size_t size() const
+        {
+            return ends.size();
+        }
+
+        shingle_view seek(doc_id doc) const
+        {
+            const auto begin = doc > 0 ? ends[doc - 1] : 0;
+            return words.subspan(begin, ends[doc] - begin);
+        }
+
+        // Seeks cost the same in any order, so there is nothing to gain from sorting
+        void seek_many(span<const doc_id> docs, vector<shingle_view>& records) const
+        {
+            records.resize(docs.size());
+            for (size_t i = 0; i < docs.size(); ++i)
+            {
+                records[i] = seek(docs[i]);
+            }
+        }
+
+        // Every record in doc id order
+        template<typename TParse>
+        void for_each(TParse&& parse) const
+        {
+            for (doc_id doc = 0; doc < ends.size(); ++doc)
+            {
+                parse(doc, seek(doc));
+            }
+        }
+    };
+
+    static_assert(record_store<flat_record_store>);
+}
@@ -0,0 +1,392 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <algorithm>
+#include <string_view>
+#include <vector>
+#include <filesystem>
+#include <functional>
+#include <thread>
+#include <exception>
+#include <stdexcept>
+#include "concurrency.h"
+
+#ifdef NDD_BZIP2
+#include <bzlib.h>
+#endif
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Input of (doc id, doc text) rows straight from the corpus files: uncompressed csv is memory-mapped, .bz2 is
+// decompressed on its own thread into a small ring of large buffers. Rows are handed out as views into those
+// buffers, only fields with escaped quotes and rows crossing a buffer boundary are copied.
+namespace similarity::input
+{
+    using std::string_view;
+
+    using row_action = std::function<void(string_view, string_view)>;
+
+    // RFC 4180 csv: the first two fields of every row, the rest of the row is ignored
+    class csv_rows
+    {
+        std::string carry; // unfinished row of the previous chunk
+        std::string id_scratch, text_scratch;
+        bool header_skipped{};
+
+        // Index of the newline ending the row, or npos. in_quotes carries the state of an unfinished scan.
+        static size_t find_row_end(string_view data, bool& in_quotes)
+        {
+            for (size_t i = 0; i < data.size(); ++i)
+            {
+                if (data[i] == '"')
+                {
+                    in_quotes = !in_quotes; // an escaped quote toggles twice
+                }
+                else if (data[i] == '\n' && !in_quotes)
+                {
+                    return i;
+                }
+            }
+            return string_view::npos;
+        }
+
+        // Field starting at pos, pos is left on the delimiter that ended it
+        static string_view read_field(string_view row, size_t& pos, std::string& scratch)
+        {
+            if (pos >= row.size() || row[pos] != '"')
+            {
+                const auto end = std::min(row.find(',', pos), row.size());
+                const auto field = row.substr(pos, end - pos);
+                pos = end;
+                return field;
+            }
+
+            const auto start = ++pos;
+            bool escaped{};
+            while (pos < row.size())
+            {
+                if (row[pos] == '"')
+                {
+                    if (pos + 1 < row.size() && row[pos + 1] == '"')
+                    {
+                        escaped = true;
+                        pos += 2;
+                        continue;
+                    }
+                    break;
+                }
+                ++pos;
+            }
+
+            const auto field = row.substr(start, pos - start);
+            pos = std::min(row.find(',', pos), row.size());
+            if (!escaped)
+            {
+                return field;
+            }
+
+            scratch.clear();
+            for (size_t i = 0; i < field.size(); ++i)
+            {
+                scratch.push_back(field[i]);
+                i += field[i] == '"';
+            }
+            return scratch;
+        }
+
+        void parse_row(string_view row, const row_action& parse)
+        {
+            if (!row.empty() && row.back() == '\r')
+            {
+                row.remove_suffix(1);
+            }
+            if (!header_skipped)
+            {
+                header_skipped = true;
+                return;
+            }
+            if (row.empty())
+            {
+                return;
+            }
+
+            size_t pos{};
+            const auto id = read_field(row, pos, id_scratch);
+            const auto text = pos < row.size() ? (++pos, read_field(row, pos, text_scratch)) : string_view{};
+            parse(id, text);
+        }
+
+        // Parses the complete rows of data, returns where the unfinished tail starts
+        size_t parse_complete_rows(string_view data, const row_action& parse)
+        {
+            size_t start{};
+            bool in_quotes{};
+            for (auto end = find_row_end(data, in_quotes); end != string_view::npos; end = find_row_end(data.substr(start), in_quotes))
+            {
+                parse_row(data.substr(start, end), parse);
+                start += end + 1;
+            }
+            return start;
+        }
+
+    public:
+        // Chunks must arrive in file order. Views passed to parse are valid during the call only.
+        void feed(string_view chunk, const row_action& parse)
+        {
+            if (!carry.empty())
+            {
+                bool in_quotes{};
+                find_row_end(carry, in_quotes);
+                const auto end = find_row_end(chunk, in_quotes);
+                if (end == string_view::npos)
+                {
+                    carry.append(chunk);
+                    return;
+                }
+
+                carry.append(chunk.substr(0, end));
+                parse_row(carry, parse);
+                carry.clear();
+                chunk.remove_prefix(end + 1);
+            }
+
+            carry.assign(chunk.substr(parse_complete_rows(chunk, parse)));
+        }
+
+        // Last row of a file without a trailing newline
+        void finish(const row_action& parse)
+        {
+            if (!carry.empty())
+            {
+                parse_row(carry, parse);
+                carry.clear();
+            }
+        }
+    };
+
+    // Read-only mapping of a whole file
+    class mapped_file
+    {
+        const char* data{};
+        size_t length{};
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping{};
+#endif
+
+        void release()
+        {
+#ifdef _WIN32
+            if (data) UnmapViewOfFile(data);
+            if (mapping) CloseHandle(mapping);
+            if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+            mapping = nullptr;
+            file = INVALID_HANDLE_VALUE;
+#else
+            if (data) ::munmap(const_cast<char*>(data), length);
+#endif
+            data = nullptr;
+        }
+
+    public:
+        // sequential tells the OS to read ahead, otherwise pages are expected to be touched at random
+        explicit mapped_file(const std::filesystem::path& path, bool sequential = true)
+        {
+            length = static_cast<size_t>(std::filesystem::file_size(path));
+            if (length == 0)
+            {
+                return;
+            }
+#ifdef _WIN32
+            file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS, nullptr);
+            mapping = file != INVALID_HANDLE_VALUE ? CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+            data = mapping ? static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+#else
+            const int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd >= 0)
+            {
+                auto* mapped = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                ::close(fd);
+                if (mapped != MAP_FAILED)
+                {
+                    ::madvise(mapped, length, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+                    data = static_cast<const char*>(mapped);
+                }
+            }
+#endif
+            if (!data)
+            {
+                release();
+                throw std::runtime_error{ "Could not map file " + path.string() };
+            }
+        }
+
+        ~mapped_file()
+        {
+            release();
+        }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        string_view view() const
+        {
+            return { data, data ? length : 0 };
+        }
+    };
+
+#ifdef NDD_BZIP2
+    // Decompresses on a thread of its own into ring_size buffers of buffer_size bytes, consumer(chunk) is called
+    // on the calling thread in file order. Concatenated streams (as written by parallel bzip2 tools) are followed.
+    inline void read_bz2_chunks(const std::filesystem::path& path, const std::function<void(string_view)>& consumer)
+    {
+        constexpr size_t buffer_size = 8 * 1024 * 1024;
+        constexpr size_t ring_size = 4;
+
+        work_queue<std::string> free_buffers, filled;
+        for (size_t i = 0; i < ring_size; ++i)
+        {
+            free_buffers.push(std::string(buffer_size, '\0'));
+        }
+
+        std::exception_ptr reader_error;
+        std::jthread reader([&]() {
+            std::FILE* file{};
+            try
+            {
+                file = std::fopen(path.string().c_str(), "rb");
+                if (!file)
+                {
+                    throw std::runtime_error{ "Could not open input file " + path.string() };
+                }
+
+                std::vector<char> compressed(1024 * 1024);
+                bz_stream stream{};
+                if (BZ2_bzDecompressInit(&stream, 0, 0) != BZ_OK)
+                {
+                    throw std::runtime_error{ "Could not start bzip2 decompression of " + path.string() };
+                }
+                bool stream_open = true;
+                bool input_done{};
+                auto refill = [&]() {
+                    stream.next_in = compressed.data();
+                    stream.avail_in = static_cast<unsigned>(std::fread(compressed.data(), 1, compressed.size(), file));
+                    input_done = stream.avail_in == 0;
+                };
+                while (stream_open)
+                {
+                    auto buffer = free_buffers.pop();
+                    if (!buffer)
+                    {
+                        break; // consumer gave up
+                    }
+
+                    buffer->resize(buffer_size);
+                    stream.next_out = buffer->data();
+                    stream.avail_out = static_cast<unsigned>(buffer->size());
+                    while (stream.avail_out > 0 && stream_open)
+                    {
+                        if (stream.avail_in == 0 && !input_done)
+                        {
+                            refill();
+                        }
+
+                        const auto rc = BZ2_bzDecompress(&stream);
+                        if (rc == BZ_STREAM_END)
+                        {
+                            // Another stream may follow, restart on whatever input is left
+                            if (stream.avail_in == 0 && !input_done)
+                            {
+                                refill();
+                            }
+                            const auto next_in = stream.next_in;
+                            const auto avail_in = stream.avail_in;
+                            BZ2_bzDecompressEnd(&stream);
+                            stream_open = avail_in > 0;
+                            if (stream_open && BZ2_bzDecompressInit(&stream, 0, 0) != BZ_OK)
+                            {
+                                throw std::runtime_error{ "Could not start bzip2 decompression of " + path.string() };
+                            }
+                            stream.next_in = next_in; // the output position is kept too, the buffer keeps filling
+                            stream.avail_in = avail_in;
+                        }
+                        else if (rc != BZ_OK || (input_done && stream.avail_in == 0 && stream.avail_out > 0))
+                        {
+                            BZ2_bzDecompressEnd(&stream);
+                            throw std::runtime_error{ "Input file is not valid bzip2 or is truncated " + path.string() };
+                        }
+                    }
+
+                    buffer->resize(buffer_size - stream.avail_out);
+                    filled.push(std::move(*buffer));
+                }
+            }
+            catch (...)
+            {
+                reader_error = std::current_exception();
+            }
+
+            if (file) std::fclose(file);
+            filled.close();
+        });
+
+        try
+        {
+            while (auto chunk = filled.pop())
+            {
+                consumer(*chunk);
+                free_buffers.push(std::move(*chunk));
+            }
+        }
+        catch (...)
+        {
+            free_buffers.close();
+            while (filled.pop()) {} // unblock and drain the reader
+            throw;
+        }
+
+        reader.join();
+        if (reader_error)
+        {
+            std::rethrow_exception(reader_error);
+        }
+    }
+#endif
+
+    // Calls parse(doc id, doc text) for every row of a .csv or .csv.bz2 file, skipping the header row
+    inline void read_csv(const std::filesystem::path& path, const row_action& parse)
+    {
+        if (!std::filesystem::exists(path))
+        {
+            throw std::runtime_error{ "Input file not found " + path.string() };
+        }
+
+        csv_rows rows;
+        if (path.extension() == ".bz2")
+        {
+#ifdef NDD_BZIP2
+            read_bz2_chunks(path, [&](string_view chunk) { rows.feed(chunk, parse); });
+#else
+            throw std::runtime_error{ "Built without bzip2 support, decompress the input first." };
+#endif
+        }
+        else
+        {
+            const mapped_file file(path);
+            rows.feed(file.view(), parse);
+        }
+        rows.finish(parse);
+    }
+}
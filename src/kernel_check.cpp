@@ -0,0 +1,116 @@
+﻿#include <cstdint>
+#include <vector>
+#include <span>
+#include <string>
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include "core.h"
+
+using namespace std;
+
+// Runs every min-hash, lane count and intersection kernel the cpu supports on the same random inputs and compares
+// each with the scalar one, which all of them have to match bit for bit. Exit code 1 on the first difference.
+// Registered with ctest; NearDupes.Check [rounds] runs it by hand.
+namespace
+{
+    using similarity::kernels::isa;
+
+    vector<uint32_t> random_set(std::mt19937& rng, size_t size, uint32_t range)
+    {
+        std::uniform_int_distribution<uint32_t> dist(0, range);
+        vector<uint32_t> set(size);
+        std::generate(set.begin(), set.end(), [&]() { return dist(rng); });
+        std::sort(set.begin(), set.end());
+        set.erase(std::unique(set.begin(), set.end()), set.end());
+        return set;
+    }
+
+    bool report(bool same, const std::string& what)
+    {
+        if (!same)
+        {
+            std::cerr << "Mismatch: " << what << std::endl;
+        }
+        return same;
+    }
+
+    // With a lower bound, a kernel returns the exact count when it reaches the bound and something below it otherwise
+    bool bounded(size_t count, size_t exact, size_t min_required)
+    {
+        return exact >= min_required ? count == exact : count < min_required;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const size_t rounds = argc > 1 ? std::stoul(argv[1]) : 200;
+    const auto supported = similarity::kernels::detect_isa();
+    vector<isa> levels = { isa::scalar };
+    if (supported >= isa::avx2) levels.push_back(isa::avx2);
+    if (supported >= isa::avx512) levels.push_back(isa::avx512);
+
+    std::mt19937 rng(random_seed);
+    std::uniform_int_distribution<uint32_t> coeff_dist;
+    vector<uint32_t> coeffs(max_signature_size);
+    std::generate(coeffs.begin(), coeffs.end(), [&]() { return coeff_dist(rng); });
+
+    bool ok = true;
+    size_t checks{};
+    for (size_t round = 0; round < rounds && ok; ++round)
+    {
+        // Sizes around the block widths of the kernels, and a narrow value range so sets overlap
+        const size_t size_a = 1 + rng() % (round % 4 == 0 ? 8 : 3000);
+        const size_t size_b = 1 + rng() % 3000;
+        const auto a = random_set(rng, size_a, 8000);
+        const auto b = random_set(rng, size_b, 8000);
+
+        for (const size_t lanes : { 1, 7, 8, 16, 63, 64, 128, 192, 256 })
+        {
+            vector<uint32_t> expected(lanes), sig(lanes), other(lanes);
+            similarity::kernels::minhash_scalar(a, coeffs.data(), expected.data(), lanes);
+            similarity::kernels::minhash_scalar(b, coeffs.data(), other.data(), lanes);
+            const auto expected_equal = similarity::kernels::equal_lanes_scalar(expected.data(), other.data(), lanes);
+            for (const auto level : levels)
+            {
+                similarity::kernels::kernel_for(level)(a, coeffs.data(), sig.data(), lanes);
+                ok &= report(sig == expected, std::string("min-hash ") + similarity::kernels::isa_name(level) + ", " + std::to_string(a.size()) + " shingles, " + std::to_string(lanes) + " lanes");
+                const auto equal = similarity::kernels::equal_lanes_for(level)(expected.data(), other.data(), lanes);
+                ok &= report(equal == expected_equal, std::string("lane count ") + similarity::kernels::isa_name(level) + ", " + std::to_string(lanes) + " lanes");
+                checks += 2;
+            }
+        }
+
+        const auto expected = similarity::kernels::intersect_merge(a, b, 0);
+        ok &= report(similarity::kernels::intersect_gallop(a.size() <= b.size() ? a : b, a.size() <= b.size() ? b : a, 0) == expected, "gallop intersection");
+#ifdef NDD_X86_64
+        if (supported >= isa::avx2)
+        {
+            ok &= report(similarity::kernels::intersect_avx2(a, b, 0) == expected, "avx2 intersection, " + std::to_string(a.size()) + " x " + std::to_string(b.size()));
+        }
+#endif
+        ok &= report(similarity::kernels::intersect_count(a, b, 0) == expected, "dispatched intersection");
+        checks += 3;
+
+        // Bounds just reachable, just out of reach and far out of reach, which stop the kernels at different points
+        const auto& small = a.size() <= b.size() ? a : b;
+        const auto& large = a.size() <= b.size() ? b : a;
+        for (const size_t min_required : { expected / 2, expected, expected + 1, small.size() })
+        {
+            const auto bound = " intersection, at least " + std::to_string(min_required) + " of " + std::to_string(expected);
+            ok &= report(bounded(similarity::kernels::intersect_merge(a, b, min_required), expected, min_required), "merge" + bound);
+            ok &= report(bounded(similarity::kernels::intersect_gallop(small, large, min_required), expected, min_required), "gallop" + bound);
+#ifdef NDD_X86_64
+            if (supported >= isa::avx2)
+            {
+                ok &= report(bounded(similarity::kernels::intersect_avx2(a, b, min_required), expected, min_required), "avx2" + bound);
+            }
+#endif
+            ok &= report(bounded(similarity::kernels::intersect_count(a, b, min_required), expected, min_required), "dispatched" + bound);
+            checks += 4;
+        }
+    }
+
+    std::cout << (ok ? "All " : "Failed after ") << checks << " kernel checks (" << similarity::kernels::isa_name(supported) << " cpu)" << std::endl;
+    return ok ? 0 : 1;
+}
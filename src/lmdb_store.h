@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <span>
+#include <mutex>
+#include <atomic>
+#include <lmdb++.h>
+#include "core.h"
+#include "utils.h"
+
+namespace similarity
+{
+    // Shingle sets of the cache, read through the per-thread read transactions of txns, so any thread may seek.
+    // Records point into the map and stay valid while txns does.
+    class lmdb_record_store
+    {
+        per_thread_read_txns& txns;
+        MDB_dbi dbi;
+        uint64_t instance;
+        mutable std::mutex mtx;
+        mutable std::vector<lmdb::cursor> cursors;
+
+        static uint64_t next_instance()
+        {
+            static std::atomic<uint64_t> counter{};
+            return ++counter;
+        }
+
+        // One cursor per thread, opened on that thread's transaction and kept for every later batch
+        MDB_cursor* thread_cursor() const
+        {
+            thread_local uint64_t owner{};
+            thread_local MDB_cursor* handle{};
+            if (owner != instance)
+            {
+                std::lock_guard lock(mtx);
+                handle = cursors.emplace_back(lmdb::cursor::open(txns.get(), dbi)).handle();
+                owner = instance;
+            }
+            return handle;
+        }
+
+    public:
+        lmdb_record_store(per_thread_read_txns& txns, MDB_dbi dbi) : txns(txns), dbi(dbi), instance(next_instance()) {}
+
+        shingle_view seek(doc_id doc) const
+        {
+            lmdb::val value;
+            lmdb::dbi_get(txns.get(), dbi, to_key(doc), value);
+            return to_span<uint32_t>(value);
+        }
+
+        // Keys are looked up in increasing order with the same cursor, Lmdb then finds most of them on the leaf page
+        // the cursor already points at instead of searching from the root
+        void seek_many(span<const doc_id> docs, vector<shingle_view>& records) const
+        {
+            thread_local vector<uint32_t> order;
+            order.resize(docs.size());
+            std::generate(order.begin(), order.end(), [i = 0u]() mutable { return i++; });
+            std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return docs[a] < docs[b]; });
+
+            records.resize(docs.size());
+            const auto handle = thread_cursor();
+            for (const auto i : order)
+            {
+                auto doc = docs[i];
+                lmdb::val key = to_key(doc), value{};
+                lmdb::cursor_get(handle, key, value, MDB_SET);
+                records[i] = to_span<uint32_t>(value);
+            }
+        }
+
+        // Every record in doc id order
+        template<typename TParse>
+        void for_each(TParse&& parse) const
+        {
+            auto cursor = lmdb::cursor::open(txns.get(), dbi);
+            lmdb::val key{}, value{};
+            while (cursor.get(key, value, MDB_NEXT))
+            {
+                parse(from_key(key), to_span<uint32_t>(value));
+            }
+            cursor.close();
+        }
+    };
+
+    static_assert(record_store<lmdb_record_store>);
+}
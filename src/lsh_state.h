@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <string>
+#include "core.h"
+
+namespace similarity
+{
+    // Value of the "groups" database: the representative of a doc (itself for representatives) and their similarity
+    struct group_entry
+    {
+        doc_id representative;
+        float score;
+    };
+
+    // Value of the "settings" database: what the cached shingles and signatures were built with
+    struct cache_settings
+    {
+        uint32_t signature_size;
+        uint32_t shingle_size;
+    };
+
+    // What an incremental run needs from earlier runs besides the Lmdb cache: the threshold the groups were built
+    // for, the shingle count of every doc and the representatives' index. Stored as a small header followed by flat
+    // arrays, so it loads with a handful of bulk reads. Written to a temporary file and renamed over the old one.
+    struct lsh_state
+    {
+        static constexpr char magic[8] = { 'N', 'D', 'D', 'L', 'S', 'H', '0', '1' };
+
+        float similarity_threshold{};
+        vector<size_t> doc_size_xref;
+        flat_lsh_index index;
+
+        void save(const std::filesystem::path& path) const
+        {
+            write(path, similarity_threshold, doc_size_xref, index.band_cnt, index.row_cnt, [&](std::ostream& out) { index.save(out); });
+        }
+
+        // save with the index written by write_index(out), for an index that is not in memory as a whole
+        template<typename TWriteIndex>
+        static void write(const std::filesystem::path& path, float similarity_threshold, const vector<size_t>& doc_size_xref, int band_cnt, int row_cnt, TWriteIndex&& write_index)
+        {
+            const auto tmp_path = std::filesystem::path(path).concat(".tmp");
+            {
+                std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+                const uint64_t doc_count = doc_size_xref.size();
+                const uint32_t sig_size = static_cast<uint32_t>(band_cnt * row_cnt);
+                out.write(magic, sizeof(magic));
+                out.write(reinterpret_cast<const char*>(&sig_size), sizeof(sig_size));
+                out.write(reinterpret_cast<const char*>(&similarity_threshold), sizeof(similarity_threshold));
+                out.write(reinterpret_cast<const char*>(&doc_count), sizeof(doc_count));
+
+                const vector<uint32_t> sizes(doc_size_xref.begin(), doc_size_xref.end());
+                out.write(reinterpret_cast<const char*>(sizes.data()), sizes.size() * sizeof(uint32_t));
+                write_index(out);
+
+                out.flush();
+                if (!out)
+                {
+                    throw std::runtime_error{ "Could not write lsh state." };
+                }
+            }
+            std::filesystem::rename(tmp_path, path);
+        }
+
+        static lsh_state load(const std::filesystem::path& path, size_t expected_signature_size)
+        {
+            std::ifstream in(path, std::ios::binary);
+            if (!in)
+            {
+                throw std::runtime_error{ "No lsh state found, run without new input first." };
+            }
+
+            char file_magic[sizeof(magic)]{};
+            uint32_t sig_size{};
+            float similarity_threshold{};
+            uint64_t doc_count{};
+            in.read(file_magic, sizeof(file_magic));
+            in.read(reinterpret_cast<char*>(&sig_size), sizeof(sig_size));
+            in.read(reinterpret_cast<char*>(&similarity_threshold), sizeof(similarity_threshold));
+            in.read(reinterpret_cast<char*>(&doc_count), sizeof(doc_count));
+            if (!in || std::memcmp(file_magic, magic, sizeof(magic)) != 0)
+            {
+                throw std::runtime_error{ "Lsh state has an unknown format." };
+            }
+            if (sig_size != expected_signature_size)
+            {
+                throw std::runtime_error{ "Lsh state was built for " + std::to_string(sig_size) + "-lane signatures, run without new input first." };
+            }
+
+            vector<uint32_t> sizes(doc_count);
+            in.read(reinterpret_cast<char*>(sizes.data()), sizes.size() * sizeof(uint32_t));
+            return { similarity_threshold, vector<size_t>(sizes.begin(), sizes.end()), flat_lsh_index::load(in) };
+        }
+    };
+}
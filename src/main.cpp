@@ -4,6 +4,7 @@
 #include <span>
 #include <tuple>
 #include <unordered_set>
+#include <unordered_map>
 #include <string>
 #include <string_view>
 #include <sstream>
@@ -16,86 +17,592 @@
 #include <chrono>
 #include <cctype>
 #include <filesystem>
+#include <optional>
+#include <limits>
+#include <cstdlib>
+#include <memory>
 #include <MurMurHash3.h>
-#include <csv.hpp>
 #include <lmdb++.h>
 #include "core.h"
+#include "lsh_state.h"
+#include "cache.h"
+#include "partition.h"
+#include "input.h"
 #include "utils.h"
 
+#ifndef _WIN32
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+extern char** environ;
+#endif
+
 using namespace std;
 
-int main()
+namespace
+{
+    // Processes started with their stdin and stdout on pipes to this one, one per argument list, see partition_channel
+    class child_processes
+    {
+        std::filesystem::path program;
+#ifndef _WIN32
+        vector<pid_t> pids;
+#endif
+
+    public:
+        vector<similarity::partition_channel> channels;
+
+        child_processes(const std::filesystem::path& program, const vector<vector<std::string>>& arg_lists) : program(program)
+        {
+#ifdef _WIN32
+            throw std::runtime_error{ "Running " + program.string() + " in parallel processes is only supported on posix systems." };
+#else
+            // A process that exits early makes writes to its pipe fail instead of ending this one
+            std::signal(SIGPIPE, SIG_IGN);
+            try
+            {
+                start(arg_lists);
+            }
+            catch (...)
+            {
+                close_and_reap();
+                throw;
+            }
+#endif
+        }
+
+        // Processes still running when this is left early (wait() was not reached) see their pipes close and exit
+        ~child_processes()
+        {
+            close_and_reap();
+        }
+
+        child_processes(const child_processes&) = delete;
+        child_processes& operator=(const child_processes&) = delete;
+
+        // Closes the pipes and waits for every process, throwing when one failed
+        void wait()
+        {
+            if (!close_and_reap())
+            {
+                throw std::runtime_error{ program.filename().string() + " failed, see its output above." };
+            }
+        }
+
+    private:
+#ifndef _WIN32
+        void start(const vector<vector<std::string>>& arg_lists)
+        {
+            for (const auto& args : arg_lists)
+            {
+                vector<char*> argv{ const_cast<char*>(program.c_str()) };
+                for (const auto& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+                argv.push_back(nullptr);
+
+                // Close-on-exec, so no process inherits the pipes of another; dup2 clears it on stdin and stdout
+                int to_child[2]{}, from_child[2]{};
+                if (::pipe2(to_child, O_CLOEXEC) != 0 || ::pipe2(from_child, O_CLOEXEC) != 0)
+                {
+                    throw std::runtime_error{ "Could not create the pipes of " + program.string() };
+                }
+                posix_spawn_file_actions_t actions;
+                ::posix_spawn_file_actions_init(&actions);
+                ::posix_spawn_file_actions_adddup2(&actions, to_child[0], STDIN_FILENO);
+                ::posix_spawn_file_actions_adddup2(&actions, from_child[1], STDOUT_FILENO);
+                pid_t pid{};
+                const int spawned = ::posix_spawn(&pid, program.c_str(), &actions, nullptr, argv.data(), environ);
+                ::posix_spawn_file_actions_destroy(&actions);
+                ::close(to_child[0]);
+                ::close(from_child[1]);
+                if (spawned != 0)
+                {
+                    ::close(to_child[1]);
+                    ::close(from_child[0]);
+                    throw std::runtime_error{ "Could not start " + program.string() };
+                }
+                pids.push_back(pid);
+                channels.push_back({ ::fdopen(from_child[0], "rb"), ::fdopen(to_child[1], "wb") });
+            }
+        }
+#endif
+
+        // Whether every process exited with 0
+        bool close_and_reap()
+        {
+            for (auto& channel : channels)
+            {
+                channel.close();
+            }
+            bool succeeded = true;
+#ifndef _WIN32
+            for (const auto pid : pids)
+            {
+                int status{};
+                succeeded &= ::waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            }
+            pids.clear();
+#endif
+            return succeeded;
+        }
+    };
+}
+
+int main(int argc, char* argv[])
 {
-	const float similarity_threshold = 0.80f;
-    csv::CSVReader reader(R"|(/workspaces/cpp-near-dupes/data/enron100k.csv)|");
+    // --signature-size 64|128|192|256 and --shingle-size n pick the sizes of a new cache, later runs read them back from it.
+    // --rows n overrides the band/row split the S-curve gives for a new index. NearDupes.Tune suggests all three for a corpus.
+    // --record-store lmdb|flat picks where a new cache keeps the shingle sets, flat is an append-only memory-mapped file.
+    // --partitions n splits the bands of a full run between n NearDupes.Partition processes and merges the groups here.
+    vector<std::string> args;
+    std::optional<uint32_t> requested_signature_size, requested_shingle_size;
+    std::optional<int> requested_rows;
+    std::optional<std::string> requested_store;
+    size_t partitions = 1;
+    for (int i = 1; i < argc; ++i)
+    {
+        const string_view arg = argv[i];
+        if (arg == "--signature-size" && i + 1 < argc) requested_signature_size = static_cast<uint32_t>(std::stoul(argv[++i]));
+        else if (arg == "--shingle-size" && i + 1 < argc) requested_shingle_size = static_cast<uint32_t>(std::stoul(argv[++i]));
+        else if (arg == "--rows" && i + 1 < argc) requested_rows = std::stoi(argv[++i]);
+        else if (arg == "--record-store" && i + 1 < argc) requested_store = argv[++i];
+        else if (arg == "--partitions" && i + 1 < argc) partitions = std::max<size_t>(1, std::stoul(argv[++i]));
+        else args.emplace_back(arg);
+    }
+    if (requested_shingle_size == 0u)
+    {
+        throw std::runtime_error{ "--shingle-size must be at least 1." };
+    }
+
+    // Re-runs reuse the ingested cache, so only a new threshold needs passing. Remove /tmp/ndd-cache/* to re-ingest.
+    // Passing an input file while the cache is populated appends its documents and groups only those (incremental run).
+    const float similarity_threshold = args.size() > 0 ? std::stof(args[0]) : 0.80f;
+    const size_t thread_count = args.size() > 1 ? std::stoul(args[1]) : similarity::default_thread_count();
+    const std::string input_path = args.size() > 2 ? args[2] : R"|(/workspaces/cpp-near-dupes/data/enron100k.csv.bz2)|";
+    const std::filesystem::path cache_dir = R"|(/tmp/ndd-cache)|";
+    const auto state_path = cache_dir / "lsh.state";
 
-    // TODO: add sampling that enable setting up shingle size, i.e choose 1k docs and compare against various shingle sizes 
+    // Caps what is kept in memory next to the representatives' index, e.g. NDD_MEMORY_BUDGET_MB=512. Unbounded when unset.
+    const char* budget_mb = std::getenv("NDD_MEMORY_BUDGET_MB");
+    const size_t memory_budget = budget_mb ? std::stoull(budget_mb) * 1024 * 1024 : std::numeric_limits<size_t>::max();
 
-    auto env = lmdb::env::create();
-    env.set_mapsize(1UL * 1024UL * 1024UL * 1024UL);
-    env.open(R"|(/tmp/ndd-cache)|", MDB_FIXEDMAP, 0664);
+    // The map starts at 1 GiB and is grown between transactions, so the cache is bounded by disk rather than a fixed map
+    auto env = similarity::open_cache(cache_dir, MDB_NOTLS);
+    grow_map_if_needed(env, 128UL * 1024UL * 1024UL); // the first ingestion commit, see commit_bytes
 
     using namespace std::chrono;
     auto start = steady_clock::now();
     auto wtxn = lmdb::txn::begin(env);
-    auto dbi = lmdb::dbi::open(wtxn, nullptr);
+    auto dbi = lmdb::dbi::open(wtxn, "shingles", MDB_CREATE);
+    auto sig_dbi = lmdb::dbi::open(wtxn, "signatures", MDB_CREATE);
+    auto ids_dbi = lmdb::dbi::open(wtxn, "docids", MDB_CREATE);
+    auto groups_dbi = lmdb::dbi::open(wtxn, "groups", MDB_CREATE);
+    auto settings_dbi = lmdb::dbi::open(wtxn, "settings", MDB_CREATE);
+    auto fingerprints_dbi = lmdb::dbi::open(wtxn, "fingerprints", MDB_CREATE); // shingle set fingerprint -> first doc with it
+    auto duplicates_dbi = lmdb::dbi::open(wtxn, "duplicates", MDB_CREATE); // exact duplicate -> its first copy
 
-    similarity::iterate_input_action iterate_csv_records = [&](similarity::parse_input_action parse) {
-        for (csv::CSVRow& row : reader)
-        {
-            auto docid = row[0].get_sv();
-            const auto doctext = row[1].get_sv();
-            assert((docid.size() > 0 && doctext.size()) || "doc data is corrupted");
-            parse(docid, doctext);
-        }
+    // A populated cache keeps the record store it was built with, shingles.meta marks the flat one
+    if (requested_store && *requested_store != "lmdb" && *requested_store != "flat")
+    {
+        throw std::runtime_error{ "Unsupported record store " + *requested_store + ", pick lmdb or flat." };
+    }
+    const bool flat_cache = similarity::flat_store::exists(cache_dir) || (dbi.size(wtxn) == 0 && requested_store == "flat");
+    auto count_records = [&]() {
+        return static_cast<similarity::doc_id>(flat_cache ? similarity::flat_commit_of(wtxn, settings_dbi).doc_count : dbi.size(wtxn));
     };
 
-    // TODO: ensure records are appended, not inserted
-    // docs: http://www.lmdb.tech/doc/group__internal.html#ga4fa8573d9236d54687c61827ebf8cac0
-    similarity::put_record_func put_record = [&](auto key, const auto& value) { return dbi.put(wtxn, to_key(key), to_val(value)); };
+    // The record count is written with the last commit of an ingestion. An interrupted one leaves the docs of the
+    // chunks it committed past it, they are cut off so the cache is as the last finished ingestion left it.
+    {
+        uint64_t ingested{};
+        settings_dbi.get(wtxn, "ingested", ingested);
+        if (count_records() > ingested)
+        {
+            std::cout << "Dropping " << count_records() - ingested << " records left by an interrupted ingestion" << std::endl;
+            const auto first_dropped = static_cast<similarity::doc_id>(ingested);
+            for (auto* doc_dbi : { &dbi, &sig_dbi, &ids_dbi, &duplicates_dbi })
+            {
+                similarity::erase_docs_from(wtxn, *doc_dbi, first_dropped);
+            }
+            similarity::erase_fingerprints_from(wtxn, fingerprints_dbi, first_dropped);
+            if (flat_cache)
+            {
+                settings_dbi.put(wtxn, "flat", similarity::flat_store::commit_at(cache_dir, ingested));
+            }
+        }
+    }
 
     similarity::doc_cacher cache;
-    cache.add_documents(iterate_csv_records, put_record);
-    std::cout << "Min-hash took " << duration_cast<seconds>(steady_clock::now() - start).count() << " sec" << std::endl;
-    std::cout << "Processed " << dbi.size(wtxn) << " records" << std::endl;
-    wtxn.commit();
+    const auto cached_count = count_records();
+    const bool incremental = cached_count > 0 && args.size() > 2;
+    if (cached_count > 0 && requested_store && (*requested_store == "flat") != flat_cache)
+    {
+        throw std::runtime_error{ std::string("The cache keeps its records in the ") + (flat_cache ? "flat" : "lmdb") + " store, remove /tmp/ndd-cache/* to change it." };
+    }
 
-    start = steady_clock::now();
-    auto rtxn = lmdb::txn::begin(env, nullptr, MDB_RDONLY);
-    dbi = lmdb::dbi::open(rtxn, nullptr);
+    // A populated cache keeps the sizes it was built with, caches from before they were stored used the defaults
+    similarity::cache_settings settings{ requested_signature_size.value_or(signature_size), requested_shingle_size.value_or(shingle_size) };
+    if (cached_count > 0)
+    {
+        settings = { signature_size, shingle_size };
+        settings_dbi.get(wtxn, "sizes", settings);
+        if (requested_signature_size.value_or(settings.signature_size) != settings.signature_size || requested_shingle_size.value_or(settings.shingle_size) != settings.shingle_size)
+        {
+            throw std::runtime_error{ "The cache was built with signature size " + std::to_string(settings.signature_size) + " and shingle size " +
+                std::to_string(settings.shingle_size) + ", remove /tmp/ndd-cache/* to change them." };
+        }
+    }
+    else
+    {
+        settings_dbi.put(wtxn, "sizes", settings);
+    }
+
+    cache.window_size = settings.shingle_size;
+    cache.signature_lanes = settings.signature_size;
 
-    similarity::iterate_records_action iterate_cache_records = [&](similarity::parse_record_action parse) {
-        auto cursor = lmdb::cursor::open(rtxn, dbi);
-        lmdb::val key{}, value{};
-        while (cursor.get(key, value, MDB_NEXT))
+    // Everything past ingestion is instantiated per signature size
+    similarity::with_signature_size(settings.signature_size, [&]<size_t SignatureSize>() {
+        using minhash_sig = similarity::basic_minhash_sig<SignatureSize>;
+
+        // Checked before anything is appended, so a mismatch leaves the cache untouched
+        std::optional<similarity::lsh_state> state;
+        if (incremental)
         {
-            parse(from_key(key), to_span<uint32_t>(value));
+            if (!similarity::groups_complete(wtxn, settings_dbi, cached_count))
+            {
+                throw std::runtime_error{ "The groups of the cache were left incomplete by an interrupted run, run without new input first." };
+            }
+            state = similarity::lsh_state::load(state_path, SignatureSize);
+            if (state->similarity_threshold != similarity_threshold || state->doc_size_xref.size() != cached_count)
+            {
+                throw std::runtime_error{ "Lsh state does not match the cache or the threshold, run without new input first." };
+            }
         }
-        cursor.close();
-    };
+        if (cached_count == 0 || incremental)
+        {
+            similarity::metrics::stage_timer timer(similarity::metrics::stage::ingest);
+            // .csv.bz2 is decompressed while parsing, plain .csv is memory-mapped
+            similarity::iterate_input_action iterate_csv_records = [&](similarity::parse_input_action parse) {
+                similarity::input::read_csv(input_path, parse);
+            };
 
-    similarity::seek_record_func seek_record = [&](auto key) {
-        lmdb::val v; dbi.get(rtxn, to_key(key), v); return to_span<uint32_t>(v);
-    };
+            // Committed every commit_bytes or so, the map can only be grown with no transaction open
+            // A flat store is synced first and its commit record goes into the same transaction, so both hold the same docs
+            constexpr size_t commit_bytes = 64UL * 1024UL * 1024UL;
+            std::optional<similarity::flat_record_writer> flat_writer;
+            if (flat_cache)
+            {
+                flat_writer.emplace(cache_dir, similarity::flat_commit_of(wtxn, settings_dbi));
+            }
+            auto commit_flat_records = [&]() {
+                if (flat_writer) settings_dbi.put(wtxn, "flat", flat_writer->sync());
+            };
+            size_t pending_bytes{};
+            auto commit_if_due = [&](size_t record_bytes) {
+                pending_bytes += record_bytes + sizeof(minhash_sig);
+                if (pending_bytes >= commit_bytes)
+                {
+                    commit_flat_records();
+                    wtxn.commit();
+                    grow_map_if_needed(env, 2 * commit_bytes);
+                    wtxn = lmdb::txn::begin(env);
+                    pending_bytes = record_bytes + sizeof(minhash_sig);
+                }
+            };
+
+            // Doc indices arrive in increasing order, so records can be appended instead of inserted
+            // docs: http://www.lmdb.tech/doc/group__internal.html#ga4fa8573d9236d54687c61827ebf8cac0
+            similarity::put_record_func put_record = [&](auto key, const auto& value) {
+                commit_if_due(value.size_bytes());
+                return flat_writer ? flat_writer->put(key, value) : dbi.put(wtxn, to_key(key), to_val(value), MDB_APPEND);
+            };
+            similarity::put_signature_func put_signature = [&](auto key, const auto& value) { return sig_dbi.put(wtxn, to_key(key), to_val(value), MDB_APPEND); };
+            similarity::put_id_func put_id = [&](auto key, auto value) { return ids_dbi.put(wtxn, to_key(key), to_val(value), MDB_APPEND); };
+
+            // Fingerprints of earlier runs count too, so appended copies of cached docs are caught as well
+            similarity::put_fingerprint_func put_fingerprint = [&](similarity::doc_id key, const similarity::doc_fingerprint& fingerprint) {
+                lmdb::val fp_key(fingerprint.data(), sizeof(similarity::doc_fingerprint)), value{};
+                if (fingerprints_dbi.get(wtxn, fp_key, value))
+                {
+                    auto original = *reinterpret_cast<const similarity::doc_id*>(value.data());
+                    auto duplicate = key;
+                    duplicates_dbi.put(wtxn, to_key(duplicate), lmdb::val(&original, sizeof(similarity::doc_id)), MDB_APPEND);
+                    return original;
+                }
+                fingerprints_dbi.put(wtxn, fp_key, lmdb::val(&key, sizeof(similarity::doc_id)));
+                return key;
+            };
+
+            cache.first_idx = cached_count;
+            cache.add_documents(iterate_csv_records, put_record, put_signature, put_id, put_fingerprint);
+            commit_flat_records();
+            settings_dbi.put(wtxn, "ingested", static_cast<uint64_t>(count_records()));
+            std::cout << "Min-hash took " << duration_cast<seconds>(steady_clock::now() - start).count() << " sec" << std::endl;
+            std::cout << "Found " << cache.duplicate_count << " exact duplicates, grouped without an index lookup" << std::endl;
+        }
+        else
+        {
+            std::cout << "Reusing cached records" << std::endl;
+        }
+        const auto doc_count = count_records();
+        std::cout << "Processed " << doc_count << " records" << std::endl;
+        wtxn.commit();
+
+        // Room for the group entries written during the LSH run
+        const auto first_new = incremental ? cached_count : similarity::doc_id{};
+        grow_map_if_needed(env, 2 * (doc_count - first_new) * (sizeof(similarity::doc_id) + sizeof(similarity::group_entry)));
+
+        start = steady_clock::now();
+        auto rtxn = lmdb::txn::begin(env, nullptr, MDB_RDONLY);
+        dbi = lmdb::dbi::open(rtxn, "shingles");
+        sig_dbi = lmdb::dbi::open(rtxn, "signatures");
+        ids_dbi = lmdb::dbi::open(rtxn, "docids");
+        duplicates_dbi = lmdb::dbi::open(rtxn, "duplicates");
+
+        // Every thread verifying candidates reads through its own transaction
+        auto reader_txns = std::make_unique<per_thread_read_txns>(env);
+
+        // Shingle sets are read from the store the cache was built with
+        auto lmdb_records = flat_cache ? nullptr : std::make_unique<similarity::lmdb_record_store>(*reader_txns, dbi);
+        auto flat_records = flat_cache ? std::make_unique<similarity::flat_record_store>(cache_dir, similarity::flat_commit_of(rtxn, settings_dbi)) : nullptr;
+        auto with_records = [&](auto&& run) {
+            if (flat_records) run(*flat_records);
+            else run(*lmdb_records);
+        };
     
-    auto groups = similarity::find_near_dupes(iterate_cache_records, dbi.size(rtxn), seek_record, similarity_threshold);
+        // One flat block of signatures indexed by doc id, starting at first_doc
+        auto load_signatures = [&](similarity::doc_id first_doc) {
+            vector<minhash_sig> signatures(sig_dbi.size(rtxn) - first_doc);
+            auto cursor = lmdb::cursor::open(rtxn, sig_dbi);
+            auto first_key = first_doc;
+            lmdb::val key = to_key(first_key), value{};
+            for (bool found = cursor.get(key, value, MDB_SET_RANGE); found; found = cursor.get(key, value, MDB_NEXT))
+            {
+                const auto sig = to_span<uint32_t>(value);
+                std::copy(sig.begin(), sig.end(), signatures.at(from_key(key) - first_doc).begin());
+            }
+            return signatures;
+        };
 
-    std::cout << "LSH took " << duration_cast<seconds>(steady_clock::now() - start).count() << " sec" << std::endl;
-    std::cout << "Produced " << groups.size() << " records" << std::endl;
-    rtxn.abort();
+        // Band-partitioned run: the workers read the cache on their own, this process only merges what they find.
+        // Incremental runs group few docs against an index the workers do not have, they always run here.
+        const bool partitioned = partitions > 1 && !incremental;
+        if (partitions > 1 && incremental)
+        {
+            std::cout << "--partitions only applies to full runs, grouping the new docs in this process" << std::endl;
+        }
 
-    std::ofstream myfile;
-    myfile.open(R"|(/tmp/ndd-groups.out.csv)|");
-    myfile << "DocA, DocB, Similarity" << std::endl;
-    int falsePositives{};
-    for (const auto& group : groups) {
-        myfile << cache.get_id_for(group.first) << ", " << cache.get_id_for(group.first) << ", 1 \n";
-        for (const auto& near_dupes : group.second)
+        // Preloaded when they fit in half the budget, read from the cache doc by doc otherwise
+        vector<minhash_sig> signatures;
+        const bool preloaded = !partitioned && (doc_count - first_new) * sizeof(minhash_sig) <= memory_budget / 2;
+        if (preloaded)
         {
-            myfile << cache.get_id_for(group.first) << ", " << cache.get_id_for(near_dupes.first) << ", " << near_dupes.second << "\n";
+            signatures = load_signatures(first_new);
         }
-    }
+        auto signature_of = [&](similarity::doc_id doc, similarity::shingle_view) {
+            return preloaded ? signatures[doc - first_new] : similarity::read_signature<SignatureSize>(reader_txns->get(), sig_dbi, doc);
+        };
+        // What the prefilter compares candidates with. Without preloaded signatures, those of representatives are kept
+        // as docs become one (a read each, see assign) while they fit in half the budget, later ones and those of
+        // earlier runs are verified exactly.
+        std::unordered_map<similarity::doc_id, minhash_sig> rep_signatures;
+        auto stored_signature_of = [&](similarity::doc_id doc) -> const minhash_sig* {
+            if (doc < first_new) return nullptr;
+            if (preloaded) return &signatures[doc - first_new];
+            const auto found = rep_signatures.find(doc);
+            return found != rep_signatures.end() ? &found->second : nullptr;
+        };
 
-    myfile.close();
-}
+        std::optional<similarity::metrics::stage_timer> lsh_timer(std::in_place, similarity::metrics::stage::lsh);
+        if (incremental)
+        {
+            with_records([&](const auto& records) {
+                for (similarity::doc_id idx = cached_count; idx < doc_count; ++idx)
+                {
+                    state->doc_size_xref.push_back(records.seek(idx).size());
+                }
+            });
+        }
+        else
+        {
+            auto [band_cnt, row_cnt] = similarity::lsh_bands_n_rows(SignatureSize, similarity_threshold);
+            if (requested_rows)
+            {
+                if (*requested_rows <= 0 || SignatureSize % *requested_rows)
+                {
+                    throw std::runtime_error{ "--rows must divide the signature size " + std::to_string(SignatureSize) + "." };
+                }
+                row_cnt = *requested_rows;
+                band_cnt = static_cast<int>(SignatureSize) / row_cnt;
+            }
+            state = similarity::lsh_state{ similarity_threshold, {}, similarity::flat_lsh_index(band_cnt, row_cnt) };
+            with_records([&](const auto& records) {
+                records.for_each([&](auto, auto shingles) { state->doc_size_xref.push_back(shingles.size()); });
+            });
+        }
+
+        // Exact duplicates among the docs to group, with their first copy. Left out of grouping, they join its group afterwards.
+        const auto duplicates = similarity::read_duplicates(rtxn, duplicates_dbi, first_new);
+
+        // Started before the groups are written, while the cache is as they found it. Built next to this executable.
+        std::optional<child_processes> workers;
+        if (partitioned)
+        {
+            const auto worker = std::filesystem::read_symlink("/proc/self/exe").parent_path() / "NearDupes.Partition";
+            vector<vector<std::string>> arg_lists;
+            for (size_t part = 0; part < partitions; ++part)
+            {
+                arg_lists.push_back({ std::to_string(part), std::to_string(partitions), args.size() > 0 ? args[0] : "0.8",
+                    std::to_string(std::max<size_t>(1, thread_count / partitions)), "--rows", std::to_string(state->index.row_cnt) });
+            }
+            workers.emplace(worker, arg_lists);
+        }
 
+        // Group state: the representative of every doc (itself for representatives) and its similarity to it.
+        // Written as docs are assigned, so groups are never held in memory, and committed every group_commit_entries
+        // entries, since Lmdb keeps the dirty pages of a transaction in memory until it commits. The map was grown for
+        // all entries above, it can not be grown while the readers are open.
+        constexpr size_t group_commit_entries = 1UL << 20;
+        size_t pending_entries{};
+        // Until "grouped" is stored again below, the groups and lsh.state count as left by an interrupted run
+        auto gtxn = lmdb::txn::begin(env);
+        groups_dbi = lmdb::dbi::open(gtxn, "groups");
+        settings_dbi.del(gtxn, lmdb::val("grouped"));
+        if (!incremental)
+        {
+            groups_dbi.drop(gtxn);
+        }
+        auto put_group = [&](similarity::doc_id doc, const similarity::group_entry& entry) {
+            if (++pending_entries > group_commit_entries)
+            {
+                gtxn.commit();
+                gtxn = lmdb::txn::begin(env);
+                pending_entries = 1;
+            }
+            groups_dbi.put(gtxn, to_key(doc), lmdb::val(&entry, sizeof(similarity::group_entry)));
+        };
+        size_t new_groups{};
+        auto assign = [&](similarity::doc_id doc, similarity::doc_id representative, float score) {
+            new_groups += doc == representative;
+            if (doc == representative && !preloaded && !partitioned && (rep_signatures.size() + 1) * sizeof(minhash_sig) <= memory_budget / 2)
+            {
+                rep_signatures.emplace(doc, similarity::read_signature<SignatureSize>(reader_txns->get(), sig_dbi, doc));
+            }
+            put_group(doc, { representative, score });
+        };
+        if (partitioned)
+        {
+            similarity::print_lsh_setup(state->index, similarity_threshold);
+            const auto docs = similarity::grouping_order(state->doc_size_xref, first_new, duplicates);
+            const auto pair_count = similarity::merge_partition_pairs(span<const similarity::doc_id>(docs), state->doc_size_xref, span(workers->channels), similarity_threshold, assign);
+            workers->wait();
+            std::cout << "Merged " << pair_count << " pairs scored by " << partitions << " processes" << std::endl;
+        }
+        else
+        {
+            with_records([&](const auto& records) {
+                similarity::stream_near_dupes(state->index, state->doc_size_xref, first_new, records, signature_of, stored_signature_of, similarity_threshold, thread_count, assign, duplicates);
+            });
+        }
+
+        // A duplicate of a representative is a member with a score of 1, a duplicate of a member joins the same group with its score.
+        // First copies are older docs, so their entries are in the groups database already, from this run or an earlier one.
+        for (auto [duplicate, original] : duplicates)
+        {
+            auto original_key = original;
+            lmdb::val value;
+            if (!groups_dbi.get(gtxn, to_key(original_key), value))
+            {
+                throw std::runtime_error{ "The cache is inconsistent: a first copy has no group, remove /tmp/ndd-cache/* and run again." };
+            }
+            auto entry = *reinterpret_cast<const similarity::group_entry*>(value.data());
+            if (entry.representative == original)
+            {
+                entry.score = 1.0f;
+            }
+            put_group(duplicate, entry);
+        }
+        {
+            similarity::metrics::stage_timer timer(similarity::metrics::stage::groups_write);
+            gtxn.commit();
+        }
+        if (partitioned)
+        {
+            // The representatives' index only exists as the band files the workers left
+            similarity::lsh_state::write(state_path, similarity_threshold, state->doc_size_xref, state->index.band_cnt, state->index.row_cnt, [&](std::ostream& out) {
+                similarity::partition_bands::write_index(out, cache_dir, state->index.band_cnt, state->index.row_cnt, partitions);
+            });
+            for (size_t part = 0; part < partitions; ++part)
+            {
+                std::filesystem::remove(similarity::partition_bands::path_of(cache_dir, part, partitions));
+            }
+        }
+        else
+        {
+            state->save(state_path);
+        }
+        {
+            auto mtxn = lmdb::txn::begin(env);
+            settings_dbi.put(mtxn, "grouped", static_cast<uint64_t>(doc_count));
+            mtxn.commit();
+        }
+        lsh_timer.reset();
+
+        std::cout << "LSH took " << duration_cast<seconds>(steady_clock::now() - start).count() << " sec" << std::endl;
+        std::cout << "Produced " << new_groups << " new groups" << std::endl;
+        const auto index_bytes = state->index.memory_usage() + state->doc_size_xref.size() * sizeof(size_t);
+        if (index_bytes > memory_budget)
+        {
+            std::cout << "Representatives' index took " << index_bytes / (1024 * 1024) << " MiB, above the memory budget" << std::endl;
+        }
+        lmdb_records.reset();
+        flat_records.reset();
+        reader_txns.reset();
+        rtxn.abort();
+
+        // Streamed from the groups database, incremental runs only write the entries of the new documents
+        std::optional<similarity::metrics::stage_timer> output_timer(std::in_place, similarity::metrics::stage::output);
+        rtxn = lmdb::txn::begin(env, nullptr, MDB_RDONLY);
+        auto get_id_for = [&](similarity::doc_id idx) -> string_view {
+            lmdb::val v; ids_dbi.get(rtxn, to_key(idx), v); return { v.data(), v.size() };
+        };
+
+        std::ofstream myfile;
+        myfile.open(incremental ? R"|(/tmp/ndd-groups.delta.csv)|" : R"|(/tmp/ndd-groups.out.csv)|");
+        myfile << "DocA, DocB, Similarity" << std::endl;
+        {
+            auto cursor = lmdb::cursor::open(rtxn, groups_dbi);
+            auto first_key = first_new;
+            lmdb::val key = to_key(first_key), value{};
+            for (bool found = cursor.get(key, value, MDB_SET_RANGE); found; found = cursor.get(key, value, MDB_NEXT))
+            {
+                const auto doc = from_key(key);
+                const auto& entry = *reinterpret_cast<const similarity::group_entry*>(value.data());
+                if (entry.representative == doc)
+                {
+                    myfile << get_id_for(doc) << ", " << get_id_for(doc) << ", 1 \n";
+                }
+                else
+                {
+                    myfile << get_id_for(entry.representative) << ", " << get_id_for(doc) << ", " << entry.score << "\n";
+                }
+            }
+        }
+
+        myfile.close();
+        rtxn.abort();
+        output_timer.reset();
+    });
+
+    if constexpr (similarity::metrics::enabled)
+    {
+        std::ofstream json(R"|(/tmp/ndd-metrics.json)|");
+        similarity::metrics::write_json(json);
+        std::ofstream prometheus(R"|(/tmp/ndd-metrics.prom)|");
+        similarity::metrics::write_prometheus(prometheus);
+        const auto prefiltered = similarity::metrics::value_of(similarity::metrics::counter::candidates_prefiltered);
+        std::cout << "Prefilter saved " << prefiltered << " record lookups and Jaccard checks of " << similarity::metrics::value_of(similarity::metrics::counter::lsh_candidates) << " candidates" << std::endl;
+        std::cout << "LSH precision " << similarity::metrics::lsh_precision() << ", metrics written to /tmp/ndd-metrics.json and /tmp/ndd-metrics.prom" << std::endl;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <iostream>
+
+// Pipeline instrumentation. Built in with NEARDUPES_METRICS (NDD_METRICS), otherwise every call compiles to nothing.
+// Hot loops collect into locals and publish once per document, all updates are relaxed atomics.
+namespace similarity::metrics
+{
+#ifdef NDD_METRICS
+    constexpr bool enabled = true;
+#else
+    constexpr bool enabled = false;
+#endif
+
+    enum class counter
+    {
+        docs_skipped_empty,     // rows dropped at ingestion for an empty text
+        docs_exact_duplicates,  // docs with the shingles of an earlier one, grouped with it without an index lookup
+        lsh_queries,            // docs looked up in the index
+        lsh_candidates,         // candidates the index returned
+        candidates_size_pruned, // candidates skipped by the size-ratio cut-off
+        candidates_prefiltered, // candidates skipped on their min-hash estimate, each saves a record lookup and a Jaccard check
+        candidates_verified,    // candidates that went through the Jaccard check
+        candidates_matched,     // verified candidates at or above the threshold
+        count_
+    };
+
+    enum class stage
+    {
+        ingest,
+        lsh,
+        groups_write,
+        output,
+        count_
+    };
+
+    enum class histogram_kind
+    {
+        shingles_per_doc,
+        candidates_per_query,
+        bucket_size,
+        count_
+    };
+
+    inline const char* name_of(counter c)
+    {
+        constexpr const char* names[] = { "docs_skipped_empty", "docs_exact_duplicates", "lsh_queries", "lsh_candidates", "candidates_size_pruned", "candidates_prefiltered", "candidates_verified", "candidates_matched" };
+        return names[static_cast<size_t>(c)];
+    }
+
+    inline const char* name_of(stage s)
+    {
+        constexpr const char* names[] = { "ingest", "lsh", "groups_write", "output" };
+        return names[static_cast<size_t>(s)];
+    }
+
+    inline const char* name_of(histogram_kind h)
+    {
+        constexpr const char* names[] = { "shingles_per_doc", "candidates_per_query", "bucket_size" };
+        return names[static_cast<size_t>(h)];
+    }
+
+    // Power-of-two buckets: bucket 0 counts zeros, bucket i counts values up to 2^i - 1
+    struct histogram
+    {
+        static constexpr size_t bucket_count = 33;
+
+        std::array<std::atomic<uint64_t>, bucket_count> buckets{};
+        std::atomic<uint64_t> count{};
+        std::atomic<uint64_t> sum{};
+
+        void observe(uint64_t value)
+        {
+            const auto bucket = std::min<size_t>(std::bit_width(value), bucket_count - 1);
+            buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+            count.fetch_add(1, std::memory_order_relaxed);
+            sum.fetch_add(value, std::memory_order_relaxed);
+        }
+
+        static uint64_t upper_bound(size_t bucket)
+        {
+            return (uint64_t{ 1 } << bucket) - 1;
+        }
+    };
+
+    struct registry
+    {
+        std::array<std::atomic<uint64_t>, static_cast<size_t>(counter::count_)> counters{};
+        std::array<std::atomic<uint64_t>, static_cast<size_t>(stage::count_)> stage_nanoseconds{};
+        std::array<histogram, static_cast<size_t>(histogram_kind::count_)> histograms{};
+    };
+
+    inline registry& global()
+    {
+        static registry instance;
+        return instance;
+    }
+
+    inline void add(counter c, uint64_t n = 1)
+    {
+        if constexpr (enabled)
+        {
+            global().counters[static_cast<size_t>(c)].fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    inline void observe(histogram_kind h, uint64_t value)
+    {
+        if constexpr (enabled)
+        {
+            global().histograms[static_cast<size_t>(h)].observe(value);
+        }
+    }
+
+    // Adds the lifetime of the scope to a stage, stages may be entered several times
+    class stage_timer
+    {
+        stage timed;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        explicit stage_timer(stage s) : timed(s)
+        {
+            if constexpr (enabled) start = std::chrono::steady_clock::now();
+        }
+
+        ~stage_timer()
+        {
+            if constexpr (enabled)
+            {
+                const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                global().stage_nanoseconds[static_cast<size_t>(timed)].fetch_add(elapsed, std::memory_order_relaxed);
+            }
+        }
+
+        stage_timer(const stage_timer&) = delete;
+        stage_timer& operator=(const stage_timer&) = delete;
+    };
+
+    inline uint64_t value_of(counter c)
+    {
+        return global().counters[static_cast<size_t>(c)].load(std::memory_order_relaxed);
+    }
+
+    inline double seconds_of(stage s)
+    {
+        return global().stage_nanoseconds[static_cast<size_t>(s)].load(std::memory_order_relaxed) / 1e9;
+    }
+
+    // Share of the returned candidates that turned out to be near-dupes
+    inline double lsh_precision()
+    {
+        const auto returned = value_of(counter::lsh_candidates);
+        return returned ? static_cast<double>(value_of(counter::candidates_matched)) / returned : 0.0;
+    }
+
+    inline void write_json(std::ostream& out)
+    {
+        const auto& r = global();
+        out << "{\n  \"counters\": {";
+        for (size_t i = 0; i < r.counters.size(); ++i)
+        {
+            out << (i ? ", " : " ") << '"' << name_of(static_cast<counter>(i)) << "\": " << r.counters[i].load();
+        }
+        out << " },\n  \"lsh_precision\": " << lsh_precision() << ",\n  \"stage_seconds\": {";
+        for (size_t i = 0; i < r.stage_nanoseconds.size(); ++i)
+        {
+            out << (i ? ", " : " ") << '"' << name_of(static_cast<stage>(i)) << "\": " << seconds_of(static_cast<stage>(i));
+        }
+        out << " },\n  \"histograms\": {\n";
+        for (size_t h = 0; h < r.histograms.size(); ++h)
+        {
+            const auto& hist = r.histograms[h];
+            out << "    \"" << name_of(static_cast<histogram_kind>(h)) << "\": { \"count\": " << hist.count.load() << ", \"sum\": " << hist.sum.load() << ", \"buckets\": [";
+            bool first = true;
+            for (size_t b = 0; b < histogram::bucket_count; ++b)
+            {
+                if (const auto n = hist.buckets[b].load())
+                {
+                    out << (first ? " " : ", ") << "{ \"le\": " << histogram::upper_bound(b) << ", \"count\": " << n << " }";
+                    first = false;
+                }
+            }
+            out << " ] }" << (h + 1 < r.histograms.size() ? ",\n" : "\n");
+        }
+        out << "  }\n}\n";
+    }
+
+    // Prometheus text exposition format, histograms with cumulative buckets
+    inline void write_prometheus(std::ostream& out)
+    {
+        const auto& r = global();
+        for (size_t i = 0; i < r.counters.size(); ++i)
+        {
+            const auto name = name_of(static_cast<counter>(i));
+            out << "# TYPE ndd_" << name << "_total counter\nndd_" << name << "_total " << r.counters[i].load() << "\n";
+        }
+        out << "# TYPE ndd_lsh_precision gauge\nndd_lsh_precision " << lsh_precision() << "\n";
+        out << "# TYPE ndd_stage_seconds gauge\n";
+        for (size_t i = 0; i < r.stage_nanoseconds.size(); ++i)
+        {
+            out << "ndd_stage_seconds{stage=\"" << name_of(static_cast<stage>(i)) << "\"} " << seconds_of(static_cast<stage>(i)) << "\n";
+        }
+        for (size_t h = 0; h < r.histograms.size(); ++h)
+        {
+            const auto& hist = r.histograms[h];
+            const auto name = name_of(static_cast<histogram_kind>(h));
+            out << "# TYPE ndd_" << name << " histogram\n";
+            uint64_t cumulative{};
+            for (size_t b = 0; b + 1 < histogram::bucket_count; ++b)
+            {
+                cumulative += hist.buckets[b].load();
+                out << "ndd_" << name << "_bucket{le=\"" << histogram::upper_bound(b) << "\"} " << cumulative << "\n";
+            }
+            out << "ndd_" << name << "_bucket{le=\"+Inf\"} " << hist.count.load() << "\n";
+            out << "ndd_" << name << "_sum " << hist.sum.load() << "\n";
+            out << "ndd_" << name << "_count " << hist.count.load() << "\n";
+        }
+    }
+}
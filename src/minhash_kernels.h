@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cstdint>
+#include <bit>
+#include <limits>
+#include <span>
+
+#include "cpu_dispatch.h"
+
+namespace similarity::kernels
+{
+    // Every kernel computes sig[i] = min over shingles of (shingle ^ coeffs[i]) for i < lanes.
+    // Results are bit-exact across kernels, only the instruction set differs.
+    using minhash_kernel_func = void(*)(std::span<const uint32_t> shingles, const uint32_t* coeffs, uint32_t* sig, size_t lanes);
+
+    // Number of lanes two signatures agree on, lanes times the min-hash estimate of their Jaccard index.
+    using equal_lanes_func = size_t(*)(const uint32_t* a, const uint32_t* b, size_t lanes);
+
+    inline void minhash_scalar(std::span<const uint32_t> shingles, const uint32_t* coeffs, uint32_t* sig, size_t lanes)
+    {
+        for (size_t i = 0; i < lanes; ++i)
+        {
+            uint32_t min = std::numeric_limits<uint32_t>::max();
+            for (const auto shingle : shingles)
+            {
+                const uint32_t a = shingle ^ coeffs[i];
+                if (a < min) min = a;
+            }
+            sig[i] = min;
+        }
+    }
+
+    inline size_t equal_lanes_scalar(const uint32_t* a, const uint32_t* b, size_t lanes)
+    {
+        size_t equal{};
+        for (size_t i = 0; i < lanes; ++i)
+        {
+            equal += a[i] == b[i];
+        }
+        return equal;
+    }
+
+#ifdef NDD_X86_64
+    // 8 accumulators x 8 lanes: each shingle is loaded and broadcast once per 64 signature lanes.
+    NDD_TARGET_AVX2 inline void minhash_avx2(std::span<const uint32_t> shingles, const uint32_t* coeffs, uint32_t* sig, size_t lanes)
+    {
+        constexpr size_t block = 64;
+        size_t i = 0;
+        for (; i + block <= lanes; i += block)
+        {
+            __m256i c[8], acc[8];
+            for (int k = 0; k < 8; ++k)
+            {
+                c[k] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(coeffs + i + k * 8));
+                acc[k] = _mm256_set1_epi32(-1);
+            }
+
+            for (const auto shingle : shingles)
+            {
+                const auto s = _mm256_set1_epi32(static_cast<int>(shingle));
+                for (int k = 0; k < 8; ++k)
+                {
+                    acc[k] = _mm256_min_epu32(acc[k], _mm256_xor_si256(s, c[k]));
+                }
+            }
+
+            for (int k = 0; k < 8; ++k)
+            {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(sig + i + k * 8), acc[k]);
+            }
+        }
+        minhash_scalar(shingles, coeffs + i, sig + i, lanes - i);
+    }
+
+    // 8 accumulators x 16 lanes: 128 signature lanes per pass over the shingles.
+    NDD_TARGET_AVX512 inline void minhash_avx512(std::span<const uint32_t> shingles, const uint32_t* coeffs, uint32_t* sig, size_t lanes)
+    {
+        constexpr size_t block = 128;
+        size_t i = 0;
+        for (; i + block <= lanes; i += block)
+        {
+            __m512i c[8], acc[8];
+            for (int k = 0; k < 8; ++k)
+            {
+                c[k] = _mm512_loadu_si512(coeffs + i + k * 16);
+                acc[k] = _mm512_set1_epi32(-1);
+            }
+
+            for (const auto shingle : shingles)
+            {
+                const auto s = _mm512_set1_epi32(static_cast<int>(shingle));
+                for (int k = 0; k < 8; ++k)
+                {
+                    acc[k] = _mm512_min_epu32(acc[k], _mm512_xor_si512(s, c[k]));
+                }
+            }
+
+            for (int k = 0; k < 8; ++k)
+            {
+                _mm512_storeu_si512(sig + i + k * 16, acc[k]);
+            }
+        }
+        minhash_avx2(shingles, coeffs + i, sig + i, lanes - i);
+    }
+
+    NDD_TARGET_AVX2 inline size_t equal_lanes_avx2(const uint32_t* a, const uint32_t* b, size_t lanes)
+    {
+        size_t equal{};
+        size_t i = 0;
+        for (; i + 8 <= lanes; i += 8)
+        {
+            const auto eq = _mm256_cmpeq_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+            equal += std::popcount(static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(eq))));
+        }
+        return equal + equal_lanes_scalar(a + i, b + i, lanes - i);
+    }
+
+    NDD_TARGET_AVX512 inline size_t equal_lanes_avx512(const uint32_t* a, const uint32_t* b, size_t lanes)
+    {
+        size_t equal{};
+        size_t i = 0;
+        for (; i + 16 <= lanes; i += 16)
+        {
+            equal += std::popcount(static_cast<uint32_t>(_mm512_cmpeq_epi32_mask(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i))));
+        }
+        return equal + equal_lanes_avx2(a + i, b + i, lanes - i);
+    }
+#endif
+
+    // Capped with NDD_MINHASH_ISA=scalar|avx2|avx512 (e.g. for benchmarking).
+    inline isa selected_isa()
+    {
+        static const isa level = capped_isa("NDD_MINHASH_ISA");
+        return level;
+    }
+
+    inline minhash_kernel_func kernel_for(isa level)
+    {
+#ifdef NDD_X86_64
+        switch (level)
+        {
+        case isa::avx512: return minhash_avx512;
+        case isa::avx2: return minhash_avx2;
+        default: break;
+        }
+#endif
+        return minhash_scalar;
+    }
+
+    inline equal_lanes_func equal_lanes_for(isa level)
+    {
+#ifdef NDD_X86_64
+        switch (level)
+        {
+        case isa::avx512: return equal_lanes_avx512;
+        case isa::avx2: return equal_lanes_avx2;
+        default: break;
+        }
+#endif
+        return equal_lanes_scalar;
+    }
+}
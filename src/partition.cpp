@@ -0,0 +1,88 @@
+﻿#include <vector>
+#include <string>
+#include <string_view>
+#include <iostream>
+#include <chrono>
+#include <filesystem>
+#include <optional>
+#include <memory>
+#include <lmdb++.h>
+#include "core.h"
+#include "partition.h"
+#include "cache.h"
+#include "utils.h"
+
+using namespace std;
+
+// One worker of a band-partitioned NearDupes.App run (--partitions), started by it once the cache is ingested.
+// Reads the cache without writing to it, so any number of workers share it, and exchanges the pairs and representatives
+// of every chunk with the App over stdin and stdout (see partition.h). Leaves the index of its bands in
+// /tmp/ndd-cache/bands.<part>-of-<parts> for the App to put lsh.state together.
+// Usage: NearDupes.Partition part parts [similarity_threshold] [thread_count] [--rows n]
+int main(int argc, char* argv[])
+{
+    vector<std::string> args;
+    std::optional<int> requested_rows;
+    for (int i = 1; i < argc; ++i)
+    {
+        const string_view arg = argv[i];
+        if (arg == "--rows" && i + 1 < argc) requested_rows = std::stoi(argv[++i]);
+        else args.emplace_back(arg);
+    }
+    if (args.size() < 2)
+    {
+        std::cerr << "Usage: NearDupes.Partition part parts [similarity_threshold] [thread_count] [--rows n]" << std::endl;
+        return 2;
+    }
+
+    const size_t part = std::stoul(args[0]);
+    const size_t parts = std::stoul(args[1]);
+    const float similarity_threshold = args.size() > 2 ? std::stof(args[2]) : 0.80f;
+    const size_t thread_count = args.size() > 3 ? std::stoul(args[3]) : similarity::default_thread_count();
+    const std::filesystem::path cache_dir = R"|(/tmp/ndd-cache)|";
+    if (part >= parts)
+    {
+        throw std::runtime_error{ "Part " + args[0] + " is not one of " + args[1] + " parts." };
+    }
+
+    auto env = similarity::open_cache(cache_dir, MDB_RDONLY | MDB_NOTLS);
+
+    using namespace std::chrono;
+    const auto start = steady_clock::now();
+    auto rtxn = lmdb::txn::begin(env, nullptr, MDB_RDONLY);
+    auto dbi = lmdb::dbi::open(rtxn, "shingles");
+    auto sig_dbi = lmdb::dbi::open(rtxn, "signatures");
+    const auto settings = similarity::read_cache_settings(rtxn);
+    const auto duplicates = similarity::read_duplicates(rtxn, lmdb::dbi::open(rtxn, "duplicates"));
+
+    // stdout carries the pairs, anything for people goes to stderr
+    similarity::partition_channel channel{ stdin, stdout };
+    auto reader_txns = std::make_unique<per_thread_read_txns>(env);
+    similarity::with_cache_records(cache_dir, rtxn, *reader_txns, dbi, [&](const auto& records) {
+        similarity::with_signature_size(settings.signature_size, [&]<size_t SignatureSize>() {
+            auto [band_cnt, row_cnt] = similarity::lsh_bands_n_rows(SignatureSize, similarity_threshold);
+            if (requested_rows)
+            {
+                row_cnt = *requested_rows;
+                band_cnt = static_cast<int>(SignatureSize) / row_cnt;
+            }
+
+            vector<size_t> doc_size_xref;
+            records.for_each([&](auto, auto shingles) { doc_size_xref.push_back(shingles.size()); });
+            const auto docs = similarity::grouping_order(doc_size_xref, 0, duplicates);
+
+            // Read from the cache as needed, every signature is read a few times at most
+            auto signature_of = [&](similarity::doc_id doc) { return similarity::read_signature<SignatureSize>(reader_txns->get(), sig_dbi, doc); };
+
+            similarity::flat_lsh_index lsh(band_cnt, row_cnt);
+            const auto pair_count = similarity::find_partition_pairs(lsh, span<const similarity::doc_id>(docs), doc_size_xref, records,
+                signature_of, similarity_threshold, part, parts, channel, thread_count);
+            similarity::partition_bands::save(similarity::partition_bands::path_of(cache_dir, part, parts), lsh, part, parts);
+            std::cerr << "Part " << part << " of " << parts << " scored " << pair_count << " pairs in " << duration_cast<milliseconds>(steady_clock::now() - start).count() << " ms" << std::endl;
+        });
+    });
+
+    channel.close();
+    reader_txns.reset();
+    rtxn.abort();
+}
@@ -0,0 +1,404 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <span>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
+#include <string>
+#include <stdexcept>
+#include "core.h"
+#include "concurrency.h"
+#include "metrics.h"
+
+// Band-partitioned grouping: the bands are split between workers (separate processes sharing the read-only cache),
+// each keeping an index of the representatives in its own bands only. The grouping order is walked in chunks of
+// partition_chunk_docs docs: every worker scores each doc of a chunk against the representatives sharing a bucket
+// with it in its bands and against the earlier docs of the chunk that do (whether those are representatives is not
+// known yet), and sends the scored pairs to the parent. A pair is sent by the worker of the lowest band it shares a
+// bucket in only. The parent replays the sequential scan over the pairs, keeping those whose other doc is a
+// representative, and answers with the new representatives of the chunk, which the workers add before scoring the
+// next one. These are exactly the candidates the index would have returned, so the groups match stream_near_dupes
+// for a full run. The parent holds no index and no signatures, and a doc is scored against the representatives of
+// its buckets plus one chunk at most.
+namespace similarity
+{
+    // doc and an earlier doc of the grouping order sharing a bucket with it. score is the Jaccard index when it reaches
+    // the threshold, 0 below it, or one of the markers below for pairs grouping does not verify.
+    struct scored_pair
+    {
+        doc_id doc;
+        doc_id other;
+        float score;
+    };
+
+    constexpr float pair_too_large = -1.0f; // other has too many shingles for doc to reach the threshold
+    constexpr float pair_prefiltered = -2.0f; // min-hash estimate below the prefilter cutoff
+    constexpr size_t partition_chunk_docs = 64; // a round trip each, larger chunks give a doc more chunk-mates to score
+
+    inline bool owns_band(int band_id, size_t part, size_t parts)
+    {
+        return static_cast<size_t>(band_id) % parts == part;
+    }
+
+    // Messages between the parent and a worker, over the worker's stdin and stdout: an item count followed by the items
+    struct partition_channel
+    {
+        std::FILE* in{};
+        std::FILE* out{};
+
+        template<typename T>
+        void send(span<const T> items)
+        {
+            const uint64_t count = items.size();
+            if (std::fwrite(&count, sizeof(count), 1, out) != 1 || std::fwrite(items.data(), sizeof(T), items.size(), out) != items.size() || std::fflush(out) != 0)
+            {
+                throw std::runtime_error{ "Could not send to the other end of a partition channel." };
+            }
+        }
+
+        template<typename T>
+        void receive(vector<T>& items)
+        {
+            uint64_t count{};
+            if (std::fread(&count, sizeof(count), 1, in) != 1)
+            {
+                throw std::runtime_error{ "The other end of a partition channel went away." };
+            }
+            items.resize(count);
+            if (std::fread(items.data(), sizeof(T), items.size(), in) != items.size())
+            {
+                throw std::runtime_error{ "Partition channel message is truncated." };
+            }
+        }
+
+        void close()
+        {
+            if (in) std::fclose(in);
+            if (out) std::fclose(out);
+            in = out = nullptr;
+        }
+    };
+
+    // Worker part of parts over docs in grouping order, talking to the parent over channel: sends the number of docs,
+    // then per chunk receives the positions of the previous chunk's representatives and sends the pairs of this one.
+    // lsh only gets postings in the owned bands. signature_of(doc) returns the signature of a doc of docs.
+    // Returns the number of pairs sent.
+    template<record_store TRecords, typename TSignatureOf>
+    size_t find_partition_pairs(flat_lsh_index& lsh, span<const doc_id> docs, const vector<size_t>& doc_size_xref, const TRecords& records,
+        TSignatureOf signature_of, const float similarity_threshold, size_t part, size_t parts, partition_channel& channel, size_t thread_count = 1)
+    {
+        assert(part < parts);
+        vector<int> owned;
+        for (int band_id = 0; band_id < lsh.band_cnt; ++band_id)
+        {
+            if (owns_band(band_id, part, parts)) owned.push_back(band_id);
+        }
+
+        const uint64_t doc_count = docs.size();
+        channel.send(span<const uint64_t>(&doc_count, 1));
+
+        thread_pool pool(thread_count);
+        const float prefilter_cutoff = similarity_threshold - prefilter_margin();
+        vector<uint32_t> hashes(partition_chunk_docs * owned.size()); // owned band hashes of the chunk's docs
+        unordered_map<uint64_t, vector<uint32_t>> chunk_buckets; // (band, bucket id) -> positions in the chunk, increasing
+        vector<vector<scored_pair>> found(partition_chunk_docs);
+        vector<uint32_t> reps;
+        vector<scored_pair> pairs;
+        size_t pair_count{};
+        auto bucket_key = [](int band_id, uint32_t bucket_id) { return (static_cast<uint64_t>(band_id) << 32) | bucket_id; };
+
+        // A pair sharing buckets in the bands of several workers is only sent by the worker of the lowest of them.
+        // The hashes of other bands are not kept, they are recomputed for the pair.
+        auto lowest_shared_band = [&](const auto& signature_a, const auto& signature_b) {
+            int band_id = 0;
+            while (lsh.hash_band(signature_a, band_id) != lsh.hash_band(signature_b, band_id)) ++band_id;
+            return band_id;
+        };
+
+        for (size_t begin = 0;; begin += partition_chunk_docs)
+        {
+            channel.receive(reps);
+            for (const auto pos : reps)
+            {
+                for (size_t k = 0; k < owned.size(); ++k)
+                {
+                    lsh.add_to_band(owned[k], docs[begin - partition_chunk_docs + pos], hashes[pos * owned.size() + k]);
+                }
+            }
+            if (begin >= docs.size())
+            {
+                break;
+            }
+
+            const auto chunk = docs.subspan(begin, std::min(partition_chunk_docs, docs.size() - begin));
+            pool.run(chunk.size(), [&](size_t pos) {
+                const auto signature = signature_of(chunk[pos]);
+                for (size_t k = 0; k < owned.size(); ++k)
+                {
+                    hashes[pos * owned.size() + k] = lsh.hash_band(signature, owned[k]);
+                }
+            });
+            chunk_buckets.clear();
+            for (size_t pos = 0; pos < chunk.size(); ++pos)
+            {
+                for (size_t k = 0; k < owned.size(); ++k)
+                {
+                    chunk_buckets[bucket_key(owned[k], hashes[pos * owned.size() + k])].push_back(static_cast<uint32_t>(pos));
+                }
+            }
+
+            pool.run(chunk.size(), [&](size_t pos) {
+                thread_local vector<doc_id> candidates;
+                thread_local vector<doc_id> selected;
+                thread_local vector<shingle_view> selected_records;
+
+                candidates.clear();
+                for (size_t k = 0; k < owned.size(); ++k)
+                {
+                    const auto bucket_id = hashes[pos * owned.size() + k];
+                    lsh.for_each_in_bucket(owned[k], bucket_id, [&](doc_id id) { candidates.push_back(id); });
+                    for (const auto other_pos : chunk_buckets.at(bucket_key(owned[k], bucket_id)))
+                    {
+                        if (other_pos >= pos) break;
+                        candidates.push_back(chunk[other_pos]);
+                    }
+                }
+                std::sort(candidates.begin(), candidates.end());
+                candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+                // The same checks in the same order as assign_near_dupes
+                const auto doc_a = chunk[pos];
+                const auto signature_a = signature_of(doc_a);
+                auto& doc_pairs = found[pos];
+                doc_pairs.clear();
+                selected.clear();
+                for (const auto doc_b : candidates)
+                {
+                    const auto signature_b = signature_of(doc_b);
+                    if (!owns_band(lowest_shared_band(signature_a, signature_b), part, parts))
+                    {
+                        continue; // sent by the worker of that band
+                    }
+
+                    if ((static_cast<float>(doc_size_xref[doc_a]) / doc_size_xref[doc_b]) < similarity_threshold)
+                    {
+                        doc_pairs.push_back({ doc_a, doc_b, pair_too_large });
+                    }
+                    else if (prefilter_cutoff > 0 && estimate_similarity(signature_a, signature_b) < prefilter_cutoff)
+                    {
+                        doc_pairs.push_back({ doc_a, doc_b, pair_prefiltered });
+                    }
+                    else
+                    {
+                        selected.push_back(doc_b);
+                    }
+                }
+
+                if (!selected.empty())
+                {
+                    const auto shingles_a = records.seek(doc_a);
+                    records.seek_many(selected, selected_records);
+                    for (size_t i = 0; i < selected.size(); ++i)
+                    {
+                        const auto score = calculate_similarity(shingles_a, selected_records[i], similarity_threshold);
+                        doc_pairs.push_back({ doc_a, selected[i], score >= similarity_threshold ? score : 0.0f });
+                    }
+                }
+            });
+
+            pairs.clear();
+            for (size_t pos = 0; pos < chunk.size(); ++pos)
+            {
+                pairs.insert(pairs.end(), found[pos].begin(), found[pos].end());
+            }
+            channel.send(span<const scored_pair>(pairs));
+            pair_count += pairs.size();
+        }
+        return pair_count;
+    }
+
+    // Parent side: replays grouping over docs in grouping order chunk by chunk with the pairs the workers send: a doc
+    // joins the best representative among the pairs it is in, or becomes one. assign as in assign_near_dupes.
+    // Returns the number of pairs received.
+    template<typename TAssign>
+    size_t merge_partition_pairs(span<const doc_id> docs, const vector<size_t>& doc_size_xref, span<partition_channel> channels,
+        const float similarity_threshold, TAssign assign)
+    {
+        vector<uint64_t> doc_count;
+        for (auto& channel : channels)
+        {
+            channel.receive(doc_count);
+            if (doc_count.size() != 1 || doc_count[0] != docs.size())
+            {
+                throw std::runtime_error{ "A partition worker does not group the docs of this run." };
+            }
+        }
+
+        vector<uint8_t> is_rep(doc_size_xref.size());
+        vector<uint32_t> reps;
+        vector<scored_pair> pairs, received;
+        vector<doc_id> candidates;
+        size_t pair_count{};
+        for (size_t begin = 0;; begin += partition_chunk_docs)
+        {
+            for (auto& channel : channels)
+            {
+                channel.send(span<const uint32_t>(reps));
+            }
+            if (begin >= docs.size())
+            {
+                break;
+            }
+
+            pairs.clear();
+            for (auto& channel : channels)
+            {
+                channel.receive(received);
+                pairs.insert(pairs.end(), received.begin(), received.end());
+            }
+            pair_count += pairs.size();
+            std::sort(pairs.begin(), pairs.end(), [](const scored_pair& a, const scored_pair& b) { return a.doc != b.doc ? a.doc < b.doc : a.other < b.other; });
+
+            reps.clear();
+            const auto chunk = docs.subspan(begin, std::min(partition_chunk_docs, docs.size() - begin));
+            for (size_t pos = 0; pos < chunk.size(); ++pos)
+            {
+                const auto doc_a = chunk[pos];
+                const auto range = std::equal_range(pairs.begin(), pairs.end(), scored_pair{ doc_a, 0, 0.0f },
+                    [](const scored_pair& a, const scored_pair& b) { return a.doc < b.doc; });
+                const auto first = range.first, last = range.second;
+                auto score_of = [&](doc_id doc_b) {
+                    return std::lower_bound(first, last, doc_b, [](const scored_pair& p, doc_id other) { return p.other < other; })->score;
+                };
+
+                // What the index would return: the representatives among the earlier docs, by doc id
+                candidates.clear();
+                for (auto p = first; p != last; ++p)
+                {
+                    if (is_rep[p->other]) candidates.push_back(p->other);
+                }
+                order_candidates(candidates, doc_size_xref);
+
+                float best_score{};
+                doc_id best_match{};
+                size_t pruned{}, skipped{}, matched{};
+                for (size_t i = 0; i < candidates.size(); ++i)
+                {
+                    const auto score = score_of(candidates[i]);
+                    if (score == pair_too_large)
+                    {
+                        pruned = candidates.size() - i;
+                        break; // this one and next candidates are too small
+                    }
+                    skipped += score == pair_prefiltered;
+                    matched += score >= similarity_threshold;
+                    if (score > best_score)
+                    {
+                        best_score = score;
+                        best_match = candidates[i];
+                    }
+                }
+
+                if constexpr (metrics::enabled)
+                {
+                    metrics::add(metrics::counter::lsh_queries);
+                    metrics::add(metrics::counter::lsh_candidates, candidates.size());
+                    metrics::add(metrics::counter::candidates_size_pruned, pruned);
+                    metrics::add(metrics::counter::candidates_prefiltered, skipped);
+                    metrics::add(metrics::counter::candidates_verified, candidates.size() - pruned - skipped);
+                    metrics::add(metrics::counter::candidates_matched, matched);
+                    metrics::observe(metrics::histogram_kind::candidates_per_query, candidates.size());
+                    metrics::observe(metrics::histogram_kind::shingles_per_doc, doc_size_xref[doc_a]);
+                }
+
+                if (best_score >= similarity_threshold)
+                {
+                    assign(doc_a, best_match, best_score);
+                }
+                else
+                {
+                    is_rep[doc_a] = 1;
+                    reps.push_back(static_cast<uint32_t>(pos));
+                    assign(doc_a, doc_a, 1.0f);
+                }
+            }
+        }
+        return pair_count;
+    }
+
+    // Band file of one worker: the tables of its bands in the format of flat_lsh_index::save, so the parent can put
+    // lsh.state together one band at a time. Written to a temporary file and renamed, so a file that exists is complete.
+    struct partition_bands
+    {
+        static constexpr char magic[8] = { 'N', 'D', 'D', 'B', 'A', 'N', 'D', '1' };
+
+        static std::filesystem::path path_of(const std::filesystem::path& dir, size_t part, size_t parts)
+        {
+            return dir / ("bands." + std::to_string(part) + "-of-" + std::to_string(parts));
+        }
+
+        static void save(const std::filesystem::path& path, const flat_lsh_index& lsh, size_t part, size_t parts)
+        {
+            const auto tmp_path = std::filesystem::path(path).concat(".tmp");
+            {
+                std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+                const uint64_t header[] = { static_cast<uint64_t>(lsh.band_cnt), static_cast<uint64_t>(lsh.row_cnt) };
+                out.write(magic, sizeof(magic));
+                out.write(reinterpret_cast<const char*>(header), sizeof(header));
+                for (int band_id = 0; band_id < lsh.band_cnt; ++band_id)
+                {
+                    if (owns_band(band_id, part, parts)) flat_lsh_index::save_band(out, lsh.bands[band_id]);
+                }
+
+                out.flush();
+                if (!out)
+                {
+                    throw std::runtime_error{ "Could not write " + tmp_path.string() };
+                }
+            }
+            std::filesystem::rename(tmp_path, path);
+        }
+
+        // The index part of lsh.state (what flat_lsh_index::save writes) from the band files of parts workers
+        static void write_index(std::ostream& out, const std::filesystem::path& dir, int band_cnt, int row_cnt, size_t parts)
+        {
+            vector<std::ifstream> files;
+            for (size_t part = 0; part < parts; ++part)
+            {
+                const auto path = path_of(dir, part, parts);
+                auto& in = files.emplace_back(path, std::ios::binary);
+                char file_magic[sizeof(magic)]{};
+                uint64_t header[2]{};
+                in.read(file_magic, sizeof(file_magic));
+                in.read(reinterpret_cast<char*>(header), sizeof(header));
+                if (!in || std::memcmp(file_magic, magic, sizeof(magic)) != 0 || header[0] != static_cast<uint64_t>(band_cnt) || header[1] != static_cast<uint64_t>(row_cnt))
+                {
+                    throw std::runtime_error{ "Band file " + path.string() + " is missing or was not written for this index." };
+                }
+            }
+
+            const uint64_t header[] = { static_cast<uint64_t>(band_cnt), static_cast<uint64_t>(row_cnt) };
+            out.write(reinterpret_cast<const char*>(header), sizeof(header));
+            flat_lsh_index::band_table band;
+            for (int band_id = 0; band_id < band_cnt; ++band_id)
+            {
+                auto& in = files[static_cast<size_t>(band_id) % parts];
+                flat_lsh_index::load_band(in, band);
+                if (!in)
+                {
+                    throw std::runtime_error{ "Band file of part " + std::to_string(band_id % parts) + " is truncated." };
+                }
+                if constexpr (metrics::enabled)
+                {
+                    flat_lsh_index::for_each_bucket_size(band, [](size_t size) { metrics::observe(metrics::histogram_kind::bucket_size, size); });
+                }
+                flat_lsh_index::save_band(out, band);
+            }
+        }
+    };
+}
@@ -0,0 +1,229 @@
+﻿#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <span>
+#include <string>
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <exception>
+#include <filesystem>
+#include <unistd.h>
+#include "core.h"
+#include "flat_store.h"
+#include "partition.h"
+
+using namespace std;
+
+// Groups a synthetic corpus in one process (stream_near_dupes) and band-partitioned over 1, 2 and 3 workers
+// (find_partition_pairs on threads, merge_partition_pairs here, talking over pipes as NearDupes.App and
+// NearDupes.Partition do), and compares every (doc, representative, score) the two hand to assign. The corpus has
+// families of near-dupes, exact duplicates and pairs right at the size cut-off of the threshold.
+// Exit code 1 on the first difference. Registered with ctest; NearDupes.PartitionCheck runs it by hand.
+namespace
+{
+    constexpr size_t check_signature_size = 256;
+    constexpr float check_threshold = 0.8f;
+    using signature_type = similarity::basic_minhash_sig<check_signature_size>;
+
+    struct assignment
+    {
+        similarity::doc_id doc;
+        similarity::doc_id representative;
+        float score;
+
+        bool operator==(const assignment&) const = default;
+    };
+
+    struct corpus
+    {
+        vector<vector<uint32_t>> sets;
+        vector<pair<similarity::doc_id, similarity::doc_id>> duplicates; // (exact duplicate, its first copy)
+    };
+
+    vector<uint32_t> random_set(std::mt19937& rng, size_t size)
+    {
+        std::uniform_int_distribution<uint32_t> dist;
+        vector<uint32_t> set(size);
+        std::generate(set.begin(), set.end(), [&]() { return dist(rng); });
+        std::sort(set.begin(), set.end());
+        set.erase(std::unique(set.begin(), set.end()), set.end());
+        return set;
+    }
+
+    // base with changed of its shingles replaced by random ones
+    vector<uint32_t> variant_of(std::mt19937& rng, vector<uint32_t> base, size_t changed)
+    {
+        std::uniform_int_distribution<uint32_t> dist;
+        for (size_t i = 0; i < changed; ++i)
+        {
+            base[rng() % base.size()] = dist(rng);
+        }
+        std::sort(base.begin(), base.end());
+        base.erase(std::unique(base.begin(), base.end()), base.end());
+        return base;
+    }
+
+    corpus make_corpus()
+    {
+        std::mt19937 rng(random_seed);
+        corpus data;
+        for (size_t family = 0; family < 60; ++family)
+        {
+            const auto base = random_set(rng, 50 + rng() % 350);
+            data.sets.push_back(base);
+            for (size_t variants = rng() % 5; variants > 0; --variants)
+            {
+                data.sets.push_back(variant_of(rng, base, base.size() * (2 + rng() % 14) / 100));
+            }
+        }
+
+        // 80 of 100 shingles is exactly 0.8, with 79 the pair is cut off by size
+        for (size_t edge = 0; edge < 20; ++edge)
+        {
+            const auto base = random_set(rng, 100);
+            data.sets.push_back(base);
+            data.sets.emplace_back(base.begin(), base.begin() + (edge % 2 ? 79 : 80));
+        }
+
+        for (size_t unrelated = 0; unrelated < 200; ++unrelated)
+        {
+            data.sets.push_back(random_set(rng, 20 + rng() % 480));
+        }
+
+        // Copies go last, so each first copy has a lower doc id as at ingestion
+        const auto originals = data.sets.size();
+        for (size_t copy = 0; copy < 30; ++copy)
+        {
+            const auto original = static_cast<similarity::doc_id>(rng() % originals);
+            data.duplicates.emplace_back(static_cast<similarity::doc_id>(data.sets.size()), original);
+            data.sets.push_back(data.sets[original]);
+        }
+        return data;
+    }
+
+    // merge_partition_pairs here against find_partition_pairs on one thread per part
+    template<similarity::record_store TRecords>
+    vector<assignment> group_partitioned(size_t parts, span<const similarity::doc_id> docs, const vector<size_t>& doc_size_xref, const TRecords& records,
+        const vector<signature_type>& signatures)
+    {
+        vector<similarity::partition_channel> parent_ends(parts), worker_ends(parts);
+        for (size_t part = 0; part < parts; ++part)
+        {
+            int to_worker[2]{}, from_worker[2]{};
+            if (::pipe(to_worker) != 0 || ::pipe(from_worker) != 0)
+            {
+                throw std::runtime_error{ "Could not create the pipes of a partition." };
+            }
+            parent_ends[part] = { ::fdopen(from_worker[0], "rb"), ::fdopen(to_worker[1], "wb") };
+            worker_ends[part] = { ::fdopen(to_worker[0], "rb"), ::fdopen(from_worker[1], "wb") };
+        }
+
+        const auto [band_cnt, row_cnt] = similarity::lsh_bands_n_rows(check_signature_size, check_threshold);
+        vector<std::exception_ptr> worker_errors(parts);
+        vector<std::jthread> workers;
+        for (size_t part = 0; part < parts; ++part)
+        {
+            workers.emplace_back([&, part]() {
+                try
+                {
+                    similarity::flat_lsh_index lsh(band_cnt, row_cnt);
+                    similarity::find_partition_pairs(lsh, docs, doc_size_xref, records, [&](similarity::doc_id doc) { return signatures[doc]; },
+                        check_threshold, part, parts, worker_ends[part]);
+                }
+                catch (...)
+                {
+                    worker_errors[part] = std::current_exception();
+                }
+                worker_ends[part].close(); // the parent sees the end of a failed worker instead of waiting on it
+            });
+        }
+
+        vector<assignment> assigned;
+        std::exception_ptr merge_error;
+        try
+        {
+            similarity::merge_partition_pairs(docs, doc_size_xref, span(parent_ends), check_threshold, [&](similarity::doc_id doc, similarity::doc_id representative, float score) {
+                assigned.push_back({ doc, representative, score });
+            });
+        }
+        catch (...)
+        {
+            merge_error = std::current_exception();
+        }
+        for (auto& channel : parent_ends)
+        {
+            channel.close();
+        }
+        workers.clear();
+
+        for (const auto& error : worker_errors)
+        {
+            if (error) std::rethrow_exception(error);
+        }
+        if (merge_error)
+        {
+            std::rethrow_exception(merge_error);
+        }
+        return assigned;
+    }
+}
+
+int main()
+{
+    const auto data = make_corpus();
+    const auto dir = std::filesystem::temp_directory_path() / ("ndd-partition-check-" + std::to_string(::getpid()));
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+
+    bool ok = true;
+    {
+        similarity::flat_store::commit_record committed{ similarity::flat_store::commit_magic, 0, 0 };
+        {
+            similarity::flat_record_writer writer(dir, committed);
+            for (similarity::doc_id doc = 0; doc < data.sets.size(); ++doc) writer.put(doc, data.sets[doc]);
+            committed = writer.sync();
+        }
+        const similarity::flat_record_store records(dir, committed);
+
+        vector<size_t> doc_size_xref;
+        vector<signature_type> signatures;
+        for (const auto& set : data.sets)
+        {
+            doc_size_xref.push_back(set.size());
+            signatures.push_back(similarity::minhash<check_signature_size>(set));
+        }
+
+        // Duplicates are left out by both, the caller assigns them
+        vector<assignment> expected;
+        {
+            const auto [band_cnt, row_cnt] = similarity::lsh_bands_n_rows(check_signature_size, check_threshold);
+            similarity::flat_lsh_index lsh(band_cnt, row_cnt);
+            similarity::stream_near_dupes(lsh, doc_size_xref, 0, records, [&](similarity::doc_id doc, similarity::shingle_view) { return signatures[doc]; },
+                [&](similarity::doc_id doc) { return &signatures[doc]; }, check_threshold, 1, [&](similarity::doc_id doc, similarity::doc_id representative, float score) {
+                    expected.push_back({ doc, representative, score });
+                }, data.duplicates);
+        }
+        const auto members = std::count_if(expected.begin(), expected.end(), [](const assignment& a) { return a.doc != a.representative; });
+        const auto at_threshold = std::count_if(expected.begin(), expected.end(), [](const assignment& a) { return a.doc != a.representative && a.score == check_threshold; });
+        std::cout << data.sets.size() << " docs, " << data.duplicates.size() << " exact duplicates, " << members << " grouped with a representative ("
+            << at_threshold << " exactly at the threshold)" << std::endl;
+
+        const auto docs = similarity::grouping_order(doc_size_xref, 0, data.duplicates);
+        for (const size_t parts : { 1, 2, 3 })
+        {
+            const auto assigned = group_partitioned(parts, span<const similarity::doc_id>(docs), doc_size_xref, records, signatures);
+            const auto mismatch = std::mismatch(expected.begin(), expected.end(), assigned.begin(), assigned.end());
+            if (mismatch.first != expected.end() || mismatch.second != assigned.end())
+            {
+                ok = false;
+                std::cerr << "Mismatch with " << parts << " parts after " << mismatch.first - expected.begin() << " of " << expected.size() << " assignments" << std::endl;
+            }
+        }
+    }
+    std::filesystem::remove_all(dir);
+
+    std::cout << (ok ? "Partitioned grouping matches" : "Partitioned grouping differs") << " for 1, 2 and 3 parts" << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <vector>
+#include <string_view>
+#include <unordered_map>
+#include "core.h"
+#include "lsh_state.h"
+
+namespace similarity
+{
+    struct query_match
+    {
+        doc_id doc;
+        float score;
+    };
+
+    using group_members = unordered_map<doc_id, vector<doc_id>>; // representative -> members
+
+    // Online lookups against the result of an earlier run: which cached documents are near-dupes of a given text.
+    // Candidates come from the representatives' index; the members of every candidate group are checked too, since
+    // only representatives were indexed. Read-only, so queries may run concurrently as long as records allows it.
+    // SignatureSize and text_processor.window_size must be those the cache was built with.
+    template<size_t SignatureSize, record_store TRecords>
+    struct near_dupe_query
+    {
+        const lsh_state& state;
+        const group_members& members;
+        const TRecords& records;
+        doc_cacher text_processor{};
+
+        // Matches at or above the threshold of the run, best first
+        vector<query_match> find(string_view text) const
+        {
+            vector<query_match> matches;
+            if (text.empty())
+            {
+                return matches;
+            }
+
+            const auto threshold = state.similarity_threshold;
+            shingle_set shingles;
+            text_processor.shingle_text(text, shingles);
+            const shingle_view shingles_a = shingles;
+
+            auto size_fits = [&](doc_id doc) {
+                const auto size_b = state.doc_size_xref.at(doc);
+                const auto ratio = static_cast<float>(std::min(shingles_a.size(), size_b)) / std::max(shingles_a.size(), size_b);
+                return ratio >= threshold; // Jaccard index can not exceed the size ratio
+            };
+
+            auto check = [&](doc_id doc, shingle_view shingles_b) {
+                const auto score = calculate_similarity(shingles_a, shingles_b, threshold);
+                if (score >= threshold)
+                {
+                    matches.push_back({ doc, score });
+                }
+            };
+
+            vector<doc_id> selected;
+            vector<shingle_view> selected_records;
+            // A member can reach the threshold when its representative does not (the query may sit on the far side of
+            // the member), so the members of every candidate group are checked whether or not the representative matched
+            for (const auto representative : state.index.get_candidates(minhash<SignatureSize>(shingles_a)))
+            {
+                selected.clear();
+                if (size_fits(representative))
+                {
+                    selected.push_back(representative);
+                }
+                if (const auto group = members.find(representative); group != members.end())
+                {
+                    std::copy_if(group->second.begin(), group->second.end(), std::back_inserter(selected), size_fits);
+                }
+
+                records.seek_many(selected, selected_records);
+                for (size_t i = 0; i < selected.size(); ++i)
+                {
+                    check(selected[i], selected_records[i]);
+                }
+            }
+
+            std::sort(matches.begin(), matches.end(), [](const auto& a, const auto& b) { return a.score > b.score || (a.score == b.score && a.doc < b.doc); });
+            return matches;
+        }
+
+        vector<vector<query_match>> find_batch(span<const string_view> texts, thread_pool& pool) const
+        {
+            vector<vector<query_match>> results(texts.size());
+            pool.run(texts.size(), [&](size_t i) { results[i] = find(texts[i]); });
+            return results;
+        }
+    };
+}
@@ -0,0 +1,144 @@
+﻿#include <vector>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <iostream>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <lmdb++.h>
+#include "core.h"
+#include "lsh_state.h"
+#include "query.h"
+#include "cache.h"
+#include "utils.h"
+
+using namespace std;
+
+// Answers near-dupe queries against the cache and groups of the last NearDupes.App run.
+// Protocol: one document text per line on stdin, with \n standing for a line break and \\ for a backslash inside it,
+// and one line per query on stdout listing "docid<TAB>score" pairs separated by tabs, best first (empty when nothing
+// matches). Lines that are already buffered are answered as one batch.
+// Usage: NearDupes.Server [thread_count]
+namespace
+{
+    // Any other backslash is kept as it is
+    void unescape_query(std::string& line)
+    {
+        size_t out{};
+        for (size_t i = 0; i < line.size(); ++i, ++out)
+        {
+            if (line[i] == '\\' && i + 1 < line.size() && (line[i + 1] == 'n' || line[i + 1] == '\\'))
+            {
+                line[out] = line[++i] == 'n' ? '\n' : '\\';
+            }
+            else
+            {
+                line[out] = line[i];
+            }
+        }
+        line.resize(out);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    // Own stdin buffer, so in_avail() tells how many queries are already waiting. Has to come before any other I/O.
+    std::ios::sync_with_stdio(false);
+
+    const size_t thread_count = argc > 1 ? std::stoul(argv[1]) : similarity::default_thread_count();
+    const std::filesystem::path cache_dir = R"|(/tmp/ndd-cache)|";
+    constexpr size_t max_batch = 1024;
+
+    auto env = similarity::open_cache(cache_dir, MDB_RDONLY | MDB_NOTLS);
+
+    auto rtxn = lmdb::txn::begin(env, nullptr, MDB_RDONLY);
+    auto dbi = lmdb::dbi::open(rtxn, "shingles");
+    auto ids_dbi = lmdb::dbi::open(rtxn, "docids");
+    auto groups_dbi = lmdb::dbi::open(rtxn, "groups");
+
+    // Queries are shingled and signed the way the cache was
+    const auto settings = similarity::read_cache_settings(rtxn);
+
+    if (!similarity::groups_complete(rtxn, lmdb::dbi::open(rtxn, "settings"), ids_dbi.size(rtxn)))
+    {
+        throw std::runtime_error{ "The groups of the cache are incomplete, rerun NearDupes.App." };
+    }
+    const auto state = similarity::lsh_state::load(cache_dir / "lsh.state", settings.signature_size);
+    if (ids_dbi.size(rtxn) != state.doc_size_xref.size())
+    {
+        throw std::runtime_error{ "Lsh state does not match the cache, rerun NearDupes.App." };
+    }
+
+    // Only representatives are indexed, members are reached through their group
+    similarity::group_members members;
+    {
+        auto cursor = lmdb::cursor::open(rtxn, groups_dbi);
+        lmdb::val key{}, value{};
+        while (cursor.get(key, value, MDB_NEXT))
+        {
+            const auto doc = from_key(key);
+            const auto entry = *reinterpret_cast<const similarity::group_entry*>(value.data());
+            if (entry.representative != doc)
+            {
+                members[entry.representative].push_back(doc);
+            }
+        }
+        cursor.close();
+    }
+    std::cerr << "Serving " << state.doc_size_xref.size() << " records at threshold " << state.similarity_threshold << std::endl;
+
+    auto reader_txns = std::make_unique<per_thread_read_txns>(env);
+    auto get_id_for = [&](similarity::doc_id idx) -> string_view {
+        lmdb::val v; ids_dbi.get(rtxn, to_key(idx), v); return { v.data(), v.size() };
+    };
+
+    auto serve = [&](const auto& records) {
+        similarity::with_signature_size(settings.signature_size, [&]<size_t SignatureSize>() {
+            similarity::thread_pool pool(thread_count);
+            similarity::near_dupe_query<SignatureSize, std::decay_t<decltype(records)>> query{ state, members, records };
+            query.text_processor.window_size = settings.shingle_size;
+
+            using namespace std::chrono;
+            vector<double> latencies_us; // from a batch being read until its answers are flushed
+            vector<string> lines;
+            string line;
+            while (std::getline(std::cin, line))
+            {
+                const auto start = steady_clock::now();
+                lines.clear();
+                lines.push_back(std::move(line));
+                while (lines.size() < max_batch && std::cin.rdbuf()->in_avail() > 0 && std::getline(std::cin, line))
+                {
+                    lines.push_back(std::move(line));
+                }
+
+                std::for_each(lines.begin(), lines.end(), unescape_query);
+                const vector<string_view> texts(lines.begin(), lines.end());
+                for (const auto& matches : query.find_batch(texts, pool))
+                {
+                    for (size_t i = 0; i < matches.size(); ++i)
+                    {
+                        std::cout << (i ? "\t" : "") << get_id_for(matches[i].doc) << '\t' << matches[i].score;
+                    }
+                    std::cout << '\n';
+                }
+                std::cout.flush();
+                latencies_us.insert(latencies_us.end(), lines.size(), duration<double, std::micro>(steady_clock::now() - start).count());
+            }
+
+            if (!latencies_us.empty())
+            {
+                std::sort(latencies_us.begin(), latencies_us.end());
+                auto percentile = [&](double p) { return latencies_us[std::min(latencies_us.size() - 1, static_cast<size_t>(p * latencies_us.size()))]; };
+                std::cerr << "Answered " << latencies_us.size() << " queries, p50 " << percentile(0.50) << " us, p99 " << percentile(0.99) << " us" << std::endl;
+            }
+        });
+    };
+
+    // Shingle sets are read from the store the cache was built with
+    similarity::with_cache_records(cache_dir, rtxn, *reader_txns, dbi, serve);
+
+    reader_txns.reset();
+    rtxn.abort();
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <bit>
+#include <span>
+
+#include "cpu_dispatch.h"
+
+namespace similarity::kernels
+{
+    // Intersection counts over sorted, duplicate-free spans (as produced by generate_shingles).
+    // Each engine stops as soon as even a perfect tail could not reach min_required and then returns
+    // a count below min_required; otherwise the exact count is returned.
+    using sorted_set = std::span<const uint32_t>;
+
+    inline size_t intersect_merge(sorted_set a, sorted_set b, size_t min_required)
+    {
+        size_t i{}, j{}, count{};
+        while (i < a.size() && j < b.size())
+        {
+            if (count + std::min(a.size() - i, b.size() - j) < min_required)
+            {
+                break;
+            }
+
+            const auto x = a[i], y = b[j];
+            count += x == y;
+            i += x <= y;
+            j += y <= x;
+        }
+        return count;
+    }
+
+    // Exponential search into the larger span for every element of the smaller one.
+    inline size_t intersect_gallop(sorted_set small, sorted_set large, size_t min_required)
+    {
+        size_t lo{}, count{};
+        for (size_t i = 0; i < small.size() && lo < large.size(); ++i)
+        {
+            if (count + (small.size() - i) < min_required)
+            {
+                break;
+            }
+
+            const auto x = small[i];
+            size_t step = 1, hi = lo;
+            while (hi < large.size() && large[hi] < x)
+            {
+                lo = hi + 1;
+                hi += step;
+                step <<= 1;
+            }
+
+            const auto end = large.begin() + std::min(hi + 1, large.size());
+            lo = std::lower_bound(large.begin() + lo, end, x) - large.begin();
+            if (lo < large.size() && large[lo] == x)
+            {
+                ++count;
+                ++lo;
+            }
+        }
+        return count;
+    }
+
+#ifdef NDD_X86_64
+    // Compares 8x8 blocks: each block of a against all 8 rotations of the block of b,
+    // then advances whichever block has the smaller maximum. The remainder goes through the merge.
+    NDD_TARGET_AVX2 inline size_t intersect_avx2(sorted_set a, sorted_set b, size_t min_required)
+    {
+        size_t i{}, j{}, count{};
+        const auto rot1 = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+        while (i + 8 <= a.size() && j + 8 <= b.size())
+        {
+            if (count + std::min(a.size() - i, b.size() - j) < min_required)
+            {
+                return count;
+            }
+
+            const auto va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a.data() + i));
+            auto vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b.data() + j));
+            auto eq = _mm256_cmpeq_epi32(va, vb);
+            for (int r = 1; r < 8; ++r)
+            {
+                vb = _mm256_permutevar8x32_epi32(vb, rot1);
+                eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(va, vb));
+            }
+            count += std::popcount(static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(eq))));
+
+            const auto a_max = a[i + 7], b_max = b[j + 7];
+            i += a_max <= b_max ? 8 : 0;
+            j += b_max <= a_max ? 8 : 0;
+        }
+
+        const auto required_tail = min_required > count ? min_required - count : 0;
+        return count + intersect_merge(a.subspan(i), b.subspan(j), required_tail);
+    }
+#endif
+
+    // Smallest intersection size for which |a & b| / |a | b| can still reach the threshold.
+    // Rounded down by one so float rounding never makes us drop a pair that would have passed.
+    inline size_t min_intersection_for(size_t size_a, size_t size_b, float threshold)
+    {
+        if (threshold <= 0.0f)
+        {
+            return 0;
+        }
+
+        const auto required = std::ceil(threshold * static_cast<double>(size_a + size_b) / (1.0 + threshold));
+        return required >= 1.0 ? static_cast<size_t>(required) - 1 : 0;
+    }
+
+    inline isa selected_intersect_isa()
+    {
+        static const isa level = capped_isa("NDD_INTERSECT_ISA");
+        return level;
+    }
+
+    // Picks an engine by size ratio: galloping when one set dwarfs the other, SIMD blocks when
+    // available and both sets are big enough to fill them, a plain merge otherwise.
+    inline size_t intersect_count(sorted_set a, sorted_set b, size_t min_required = 0)
+    {
+        constexpr size_t gallop_ratio = 32;
+        constexpr size_t simd_min_size = 16;
+
+        if (a.size() > b.size())
+        {
+            std::swap(a, b);
+        }
+
+        if (a.empty())
+        {
+            return 0;
+        }
+
+        if (b.size() / a.size() >= gallop_ratio)
+        {
+            return intersect_gallop(a, b, min_required);
+        }
+
+#ifdef NDD_X86_64
+        static const bool use_simd = selected_intersect_isa() >= isa::avx2;
+        if (use_simd && a.size() >= simd_min_size)
+        {
+            return intersect_avx2(a, b, min_required);
+        }
+#endif
+
+        return intersect_merge(a, b, min_required);
+    }
+}
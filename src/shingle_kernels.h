@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cstdint>
+#include <cctype>
+#include <array>
+#include <vector>
+#include <string_view>
+#include <algorithm>
+#include <MurMurHash3.h>
+
+namespace similarity::kernels
+{
+    // isspace/tolower of every byte, looked up instead of called per character. Built on first use,
+    // so it follows the locale in effect then, like the calls it replaces.
+    struct char_classes
+    {
+        std::array<uint8_t, 256> space{};
+        std::array<char, 256> lower{};
+
+        static const char_classes& get()
+        {
+            static const char_classes table = []() {
+                char_classes t;
+                for (int c = 0; c < 256; ++c)
+                {
+                    t.space[c] = isspace(c) ? 1 : 0;
+                    t.lower[c] = static_cast<char>(std::tolower(c));
+                }
+                return t;
+            }();
+            return table;
+        }
+    };
+
+    // Buffers reused from one document to the next
+    struct shingle_scratch
+    {
+        std::vector<char> text;
+        std::vector<uint32_t> boundaries;
+        std::vector<uint32_t> sort_buffer;
+    };
+
+    // LSD radix sort, a byte per pass with all four histograms counted up front. Beats comparison sorts
+    // from a few dozen hashes on, which is most documents.
+    inline void radix_sort(std::vector<uint32_t>& keys, std::vector<uint32_t>& buffer)
+    {
+        constexpr size_t min_radix_size = 64;
+        if (keys.size() < min_radix_size)
+        {
+            std::sort(keys.begin(), keys.end());
+            return;
+        }
+
+        uint32_t counts[4][256]{};
+        for (const auto key : keys)
+        {
+            ++counts[0][key & 0xff];
+            ++counts[1][(key >> 8) & 0xff];
+            ++counts[2][(key >> 16) & 0xff];
+            ++counts[3][key >> 24];
+        }
+
+        buffer.resize(keys.size());
+        uint32_t* from = keys.data();
+        uint32_t* to = buffer.data();
+        for (int pass = 0; pass < 4; ++pass)
+        {
+            uint32_t offsets[256];
+            uint32_t sum{};
+            for (int b = 0; b < 256; ++b)
+            {
+                offsets[b] = sum;
+                sum += counts[pass][b];
+            }
+
+            const auto shift = pass * 8;
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                to[offsets[(from[i] >> shift) & 0xff]++] = from[i];
+            }
+            std::swap(from, to);
+        }
+        // After an even number of passes the sorted keys are back in keys
+    }
+
+    // Normalizes (whitespace runs -> one space, lower case), finds the word boundaries and hashes every window of
+    // window_size words in one pass, into out (sorted, duplicate-free). Bit-exact with normalize_text + generate_shingles:
+    // windows run between boundaries, the first boundary is offset 0 whether or not it is a space, words after the last
+    // space are not shingled and texts with fewer than window_size + 1 boundaries produce the single shingle 0.
+    inline void shingle_text(std::string_view data, std::vector<uint32_t>& out, shingle_scratch& scratch, size_t window_size, uint32_t seed)
+    {
+        const auto& classes = char_classes::get();
+        if (scratch.text.size() < data.size())
+        {
+            scratch.text.resize(std::max(data.size(), scratch.text.size() * 2));
+        }
+
+        auto& boundaries = scratch.boundaries;
+        boundaries.clear();
+        boundaries.push_back(0);
+
+        char* const norm = scratch.text.data();
+        uint32_t length{};
+        bool in_space{};
+        for (const char ch : data)
+        {
+            const auto c = static_cast<unsigned char>(ch);
+            if (classes.space[c])
+            {
+                if (in_space)
+                {
+                    continue;
+                }
+                in_space = true;
+                if (length > 0)
+                {
+                    boundaries.push_back(length);
+                }
+                norm[length++] = ' ';
+            }
+            else
+            {
+                in_space = false;
+                norm[length++] = classes.lower[c];
+            }
+        }
+
+        out.clear();
+        if (boundaries.size() <= window_size)
+        {
+            out.push_back(0);
+            return;
+        }
+
+        out.resize(boundaries.size() - window_size);
+        for (size_t i = window_size; i < boundaries.size(); ++i)
+        {
+            auto start = boundaries[i - window_size];
+            start += norm[start] == ' ';
+            MurmurHash3_x86_32(norm + start, static_cast<int>(boundaries[i] - start), seed, out[i - window_size]);
+        }
+
+        radix_sort(out, scratch.sort_buffer);
+        out.erase(std::unique(out.begin(), out.end()), out.end());
+    }
+}
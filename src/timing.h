@@ -0,0 +1,23 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+namespace similarity
+{
+    // Seconds the fastest of repetitions runs of stage took: the least disturbed run is the closest to what the code costs
+    template<typename TStage>
+    double time_best_of(size_t repetitions, TStage&& stage)
+    {
+        using namespace std::chrono;
+        auto best = std::numeric_limits<double>::max();
+        for (size_t i = 0; i < repetitions; ++i)
+        {
+            const auto start = steady_clock::now();
+            stage();
+            best = std::min(best, duration<double>(steady_clock::now() - start).count());
+        }
+        return best;
+    }
+}
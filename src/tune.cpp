@@ -0,0 +1,212 @@
+﻿#include <cstdlib>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <sstream>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <chrono>
+#include "core.h"
+#include "input.h"
+#include "timing.h"
+
+using namespace std;
+
+// Picks shingle size, signature size and band/row split on a random sample of the corpus. Exact pairwise Jaccard of the
+// sample is the ground truth; every combination is scored by recall (share of the truly similar pairs that LSH returns
+// and verification keeps), candidate pairs and the time min-hash, LSH and verification take on the sample.
+// The cheapest combination reaching the target recall is printed as NearDupes.App options.
+// Similar pairs in a sample are mostly near-identical, so a split must also reach the target on the S-curve at the
+// threshold itself, which covers the borderline pairs a sample rarely holds.
+// Shingle size changes which pairs count as near-dupes, so each one is scored against the ground truth of its own shingles.
+// Usage: NearDupes.Tune [--sample 1000] [--recall 0.95] [--threshold 0.8] [--shingle-sizes 2,3,4,5] [--seed 71] [--repetitions 3] [input_csv]
+namespace
+{
+    using pair_list = vector<pair<similarity::doc_id, similarity::doc_id>>;
+
+    struct tune_result
+    {
+        size_t shingle_size{};
+        size_t signature_size{};
+        int band_cnt{};
+        int row_cnt{};
+        size_t candidate_pairs{};
+        double recall{};
+        double curve_recall{}; // chance of a pair exactly at the threshold becoming a candidate
+        double seconds{};
+    };
+
+    // Reservoir sample of the non-empty doc texts, in one pass over the input
+    vector<std::string> sample_texts(const std::string& path, size_t sample_size, uint32_t seed)
+    {
+        vector<std::string> sample;
+        std::mt19937_64 rng(seed);
+        size_t seen{};
+        similarity::input::read_csv(path, [&](string_view, string_view doctext) {
+            if (doctext.empty())
+            {
+                return; // skipped at ingestion too
+            }
+
+            ++seen;
+            if (sample.size() < sample_size)
+            {
+                sample.emplace_back(doctext);
+            }
+            else if (const auto slot = std::uniform_int_distribution<size_t>(0, seen - 1)(rng); slot < sample_size)
+            {
+                sample[slot] = doctext;
+            }
+        });
+        return sample;
+    }
+
+    // Ground truth: how many sample pairs are at or above the threshold
+    size_t count_similar_pairs(const vector<similarity::shingle_set>& shingles, float threshold)
+    {
+        size_t similar{};
+        for (size_t a = 0; a < shingles.size(); ++a)
+        {
+            for (size_t b = a + 1; b < shingles.size(); ++b)
+            {
+                const auto ratio = static_cast<float>(std::min(shingles[a].size(), shingles[b].size())) / std::max(shingles[a].size(), shingles[b].size());
+                if (ratio < threshold)
+                {
+                    continue; // Jaccard index can not exceed the size ratio
+                }
+                similar += similarity::calculate_similarity(similarity::shingle_view(shingles[a]), similarity::shingle_view(shingles[b]), threshold) >= threshold;
+            }
+        }
+        return similar;
+    }
+
+    // Every band/row split of SignatureSize: docs are added one by one and paired with the candidates the index returns
+    // for them, the way grouping sees them, then the pairs are verified exactly. Verified pairs are true positives.
+    template<size_t SignatureSize>
+    void tune_splits(const vector<similarity::shingle_set>& shingles, size_t similar_pairs, size_t shingle_size, float threshold, size_t repetitions, vector<tune_result>& results)
+    {
+        vector<similarity::basic_minhash_sig<SignatureSize>> signatures(shingles.size());
+        const auto minhash_seconds = similarity::time_best_of(repetitions, [&]() {
+            for (size_t i = 0; i < shingles.size(); ++i) signatures[i] = similarity::minhash<SignatureSize>(shingles[i]);
+        });
+
+        for (int rows = 1; rows <= static_cast<int>(SignatureSize); ++rows)
+        {
+            if (SignatureSize % rows) continue;
+            const int bands = static_cast<int>(SignatureSize) / rows;
+
+            pair_list candidates;
+            const auto lsh_seconds = similarity::time_best_of(repetitions, [&]() {
+                similarity::flat_lsh_index lsh(bands, rows);
+                candidates.clear();
+                for (similarity::doc_id doc = 0; doc < signatures.size(); ++doc)
+                {
+                    const auto hashes = lsh.hash_bands(signatures[doc]);
+                    for (const auto other : lsh.get_candidates(hashes)) candidates.emplace_back(other, doc);
+                    lsh.add(doc, hashes);
+                }
+            });
+
+            size_t matched{};
+            const auto verify_seconds = similarity::time_best_of(repetitions, [&]() {
+                matched = 0;
+                for (const auto& [a, b] : candidates)
+                {
+                    matched += similarity::calculate_similarity(similarity::shingle_view(shingles[a]), similarity::shingle_view(shingles[b]), threshold) >= threshold;
+                }
+            });
+
+            const auto recall = similar_pairs ? static_cast<double>(matched) / similar_pairs : 1.0;
+            const double curve_recall = similarity::lsh_cp_probability(bands, rows, threshold);
+            results.push_back({ shingle_size, SignatureSize, bands, rows, candidates.size(), recall, curve_recall, minhash_seconds + lsh_seconds + verify_seconds });
+        }
+    }
+
+    vector<size_t> parse_list(const std::string& list)
+    {
+        vector<size_t> values;
+        std::istringstream in(list);
+        for (std::string item; std::getline(in, item, ',');)
+        {
+            values.push_back(std::stoul(item));
+        }
+        return values;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    size_t sample_size = 1000;
+    double target_recall = 0.95;
+    float similarity_threshold = 0.80f;
+    vector<size_t> shingle_sizes = { 2, 3, 4, 5 };
+    uint32_t seed = random_seed;
+    size_t repetitions = 3;
+    std::string input_path = R"|(/workspaces/cpp-near-dupes/data/enron100k.csv.bz2)|";
+    for (int i = 1; i < argc; ++i)
+    {
+        const string_view arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--sample" && has_value) sample_size = std::max<size_t>(2, std::stoul(argv[++i]));
+        else if (arg == "--recall" && has_value) target_recall = std::stod(argv[++i]);
+        else if (arg == "--threshold" && has_value) similarity_threshold = std::stof(argv[++i]);
+        else if (arg == "--shingle-sizes" && has_value) shingle_sizes = parse_list(argv[++i]);
+        else if (arg == "--seed" && has_value) seed = static_cast<uint32_t>(std::stoul(argv[++i]));
+        else if (arg == "--repetitions" && has_value) repetitions = std::max<size_t>(1, std::stoul(argv[++i]));
+        else input_path = arg;
+    }
+
+    const auto texts = sample_texts(input_path, sample_size, seed);
+    std::cout << "Tuning on " << texts.size() << " sampled docs for recall " << target_recall << " at threshold " << similarity_threshold << std::endl;
+
+    vector<tune_result> results;
+    for (const auto shingle_size : shingle_sizes)
+    {
+        similarity::doc_cacher text_processor;
+        text_processor.window_size = shingle_size;
+        vector<similarity::shingle_set> shingles(texts.size());
+        for (size_t i = 0; i < texts.size(); ++i) text_processor.shingle_text(texts[i], shingles[i]);
+
+        const auto similar_pairs = count_similar_pairs(shingles, similarity_threshold);
+        std::cout << "Shingle size " << shingle_size << ": " << similar_pairs << " similar pairs in the sample" << std::endl;
+        if (similar_pairs == 0)
+        {
+            std::cout << "  no similar pairs to measure recall on, use a larger --sample" << std::endl;
+        }
+
+        for (const size_t sig_size : { 64, 128, 192, 256 })
+        {
+            similarity::with_signature_size(sig_size, [&]<size_t SignatureSize>() {
+                tune_splits<SignatureSize>(shingles, similar_pairs, shingle_size, similarity_threshold, repetitions, results);
+            });
+        }
+    }
+
+    std::cout << "shingle signature bands rows candidates recall curve seconds" << std::endl;
+    for (const auto& r : results)
+    {
+        std::cout << std::setw(7) << r.shingle_size << std::setw(10) << r.signature_size << std::setw(6) << r.band_cnt << std::setw(5) << r.row_cnt
+            << std::setw(11) << r.candidate_pairs << std::setw(7) << std::fixed << std::setprecision(3) << r.recall << std::setw(6) << r.curve_recall << std::setw(8) << std::setprecision(4) << r.seconds
+            << std::defaultfloat << std::endl;
+    }
+
+    // Cheapest reaching the target, the best recall when none does
+    const auto meets = [&](const tune_result& r) { return std::min(r.recall, r.curve_recall) >= target_recall; };
+    const auto best = std::min_element(results.begin(), results.end(), [&](const auto& a, const auto& b) {
+        if (meets(a) != meets(b)) return meets(a);
+        return meets(a) ? a.seconds < b.seconds : std::min(a.recall, a.curve_recall) > std::min(b.recall, b.curve_recall);
+    });
+    if (best == results.end())
+    {
+        return 1;
+    }
+
+    const auto [default_bands, default_rows] = similarity::lsh_bands_n_rows(best->signature_size, similarity_threshold);
+    std::cout << (meets(*best) ? "Cheapest configuration reaching the target recall: " : "No configuration reaches the target recall, best one: ")
+        << "--shingle-size " << best->shingle_size << " --signature-size " << best->signature_size << " --rows " << best->row_cnt
+        << " (recall " << best->recall << ", " << best->curve_recall << " at the threshold, " << best->candidate_pairs << " candidate pairs; the S-curve alone would pick "
+        << default_bands << " bands and " << default_rows << " rows)" << std::endl;
+    return meets(*best) ? 0 : 1;
+}
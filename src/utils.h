@@ -4,9 +4,12 @@
 #include <array>
 #include <vector>
 #include <span>
+#include <mutex>
+#include <atomic>
 #include <lmdb++.h>
 
-#ifdef _DEBUG
+// MSVC defines _DEBUG for debug builds, GCC and Clang only leave NDEBUG undefined
+#if defined(_DEBUG) || !defined(NDEBUG)
 constexpr bool debug_mode = true;
 #else
 constexpr bool debug_mode = false;
@@ -29,6 +32,18 @@ inline auto to_val(const std::vector<T>& vec)
     return lmdb::val(vec.data(), vec.size() * sizeof(T));
 }
 
+template<typename T>
+inline auto to_val(std::span<const T> items)
+{
+    return lmdb::val(items.data(), items.size_bytes());
+}
+
+template<typename T, size_t N>
+inline auto to_val(const std::array<T, N>& arr)
+{
+    return lmdb::val(arr.data(), N * sizeof(T));
+}
+
 //template<typename T, typename std::enable_if<std::is_integral_v<T>, int>::type = 0>
 template<typename T, typename = std::enable_if<std::is_integral_v<T>>>
 inline auto to_key(T& id)
@@ -50,3 +65,56 @@ inline auto to_span(const lmdb::val& val)
 {
     return std::span<const T>(reinterpret_cast<const T*>(val.data()), val.size() / sizeof(T));
 }
+
+// Lmdb does not grow its map by itself, a write that does not fit fails the whole transaction. Doubles the map while
+// committed pages plus headroom_bytes would fill more than half of it. Only call while this process has no transaction open.
+inline void grow_map_if_needed(MDB_env* env, size_t headroom_bytes = 0)
+{
+    MDB_envinfo info{};
+    MDB_stat stat{};
+    lmdb::env_info(env, &info);
+    lmdb::env_stat(env, &stat);
+
+    const size_t needed = (info.me_last_pgno + 1) * stat.ms_psize + headroom_bytes;
+    auto map_size = info.me_mapsize;
+    while (needed * 2 > map_size)
+    {
+        map_size *= 2;
+    }
+    if (map_size != info.me_mapsize)
+    {
+        lmdb::env_set_mapsize(env, map_size);
+    }
+}
+
+// Lmdb read transactions must not be shared between threads, this hands every thread its own.
+// The environment has to be opened with MDB_NOTLS when a thread also holds another read transaction.
+class per_thread_read_txns
+{
+    MDB_env* env;
+    uint64_t instance;
+    std::mutex mtx;
+    std::vector<lmdb::txn> txns;
+
+    static uint64_t next_instance()
+    {
+        static std::atomic<uint64_t> counter{};
+        return ++counter;
+    }
+
+public:
+    explicit per_thread_read_txns(MDB_env* env) : env(env), instance(next_instance()) {}
+
+    MDB_txn* get()
+    {
+        thread_local uint64_t owner{};
+        thread_local MDB_txn* txn{};
+        if (owner != instance)
+        {
+            std::lock_guard lock(mtx);
+            txn = txns.emplace_back(lmdb::txn::begin(env, nullptr, MDB_RDONLY)).handle();
+            owner = instance;
+        }
+        return txn;
+    }
+};